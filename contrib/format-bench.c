@@ -0,0 +1,251 @@
+/* Compares the compiled formats with the token list renderer they
+ * replaced (kept below, trimmed to full songs), on a few formats and a
+ * song built locally, so no mpd is needed. The outputs are checked to be
+ * the same first.
+ *
+ * Usage: format-bench [-n ROUNDS]
+ * Build: make format-bench */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <mpd/client.h>
+
+#include "formats.h"
+
+static const char *formats[] = {
+	"%artist%%title||| - %%album| (|)%",
+	"[%state%] %artist% - %title% (%time%) vol %volume%",
+	"%file%",
+};
+
+static const struct mpd_pair song_pairs[] = {
+	{"file", "music/Some Artist/Some Album/07 - Some Fairly Long Title.flac"},
+	{"Artist", "Some Artist"},
+	{"Title", "Some Fairly Long Title (Extended Remix)"},
+	{"Album", "Some Album (Remastered)"},
+	{"Time", "312"},
+	{"Pos", "6"},
+};
+
+static const struct mpd_pair status_pairs[] = {
+	{"volume", "80"},
+	{"state", "play"},
+	{"playlistlength", "12"},
+};
+
+static struct format_strings strings = {"playing", "stopped", "paused", "unknown"};
+
+// the renderer before formats were compiled
+struct format_token {
+	bool tag;
+	char *contents, *prefix, *suffix, *condprefix;
+	struct format_token *next;
+};
+
+static char *old_tag(struct format_data *data, char *tag) {
+	struct mpd_status *status = data->status;
+	struct mpd_song *song = data->song;
+	enum mpd_tag_type t = mpd_tag_name_iparse(tag);
+	char *c;
+	int i;
+	if (!strcasecmp(tag, "state")) {
+		switch (mpd_status_get_state(status)) {
+		case MPD_STATE_PLAY:
+			return strdup(strings.play);
+		case MPD_STATE_PAUSE:
+			return strdup(strings.pause);
+		case MPD_STATE_STOP:
+			return strdup(strings.stop);
+		case MPD_STATE_UNKNOWN:
+			return strdup(strings.unknown);
+		}
+	} else if (!strcasecmp(tag, "volume")) {
+		i = mpd_status_get_volume(status);
+		c = calloc(1, 11);
+		sprintf(c, "%u", (unsigned) i);
+		return c;
+	}
+	if (t > -1) {
+		return mpd_song_get_tag(song, t, 0) ?
+			strdup(mpd_song_get_tag(song, t, 0)) : NULL;
+	} else if (!strcasecmp(tag, "time") || !strcasecmp(tag, "length")) {
+		c = calloc(1, 11);
+		sprintf(c, "%u", mpd_song_get_duration(song));
+		return c;
+	} else if (!strcasecmp(tag, "file") || !strcasecmp(tag, "uri")) {
+		return strdup(mpd_song_get_uri(song));
+	}
+	return NULL;
+}
+
+static int old_format_song(char **c, struct format_data *data, struct format_token *format) {
+	size_t s = 128, pos = 0, len;
+	int cnt = 0;
+	char *buf, *p;
+	bool pt = false;
+	*c = calloc(s, 1);
+	for (; format; format = format->next) {
+		if (format->tag) {
+			buf = old_tag(data, format->contents);
+			if (!buf || !*buf) {
+				pt = false;
+				free(buf);
+				continue;
+			}
+			if (mpd_tag_name_iparse(format->contents) > -1)
+				cnt++;
+			len = strlen(buf) +
+				(format->prefix ? strlen(format->prefix) : 0) +
+				(format->suffix ? strlen(format->suffix) : 0) +
+				(pt && format->condprefix ? strlen(format->condprefix) : 0) + 1;
+			p = calloc(1, len);
+			if (pt && format->condprefix)
+				strcat(p, format->condprefix);
+			if (format->prefix)
+				strcat(p, format->prefix);
+			strcat(p, buf);
+			if (format->suffix)
+				strcat(p, format->suffix);
+			free(buf);
+			buf = p;
+			pt = true;
+		} else {
+			buf = strdup(format->contents);
+		}
+		len = pos + strlen(buf);
+		while (len + 1 > s)
+			*c = realloc(*c, s += 128);
+		pos = len;
+		strcat(*c, buf);
+		free(buf);
+	}
+	return cnt;
+}
+
+static int old_get_token(const char *format, struct format_token *tok) {
+	int cnt = 0, i = 0;
+	const char *c = format;
+	char **p;
+	tok->tag = *format == '%';
+	tok->contents = tok->prefix = tok->suffix = tok->condprefix = NULL;
+	tok->next = NULL;
+	if (tok->tag) {
+		c++, cnt++, format++;
+		if (*format == '%' || !*format) {
+			tok->tag = false;
+			tok->contents = strdup("%");
+			return cnt;
+		}
+	}
+	for (; *format; format++) {
+		cnt++;
+		if (*format == '%') {
+			if (!tok->tag)
+				cnt--;
+			break;
+		}
+		if (*format != '|' || !tok->tag || i == 3)
+			continue;
+		p = i == 0 ? &tok->contents : i == 1 ? &tok->prefix :
+			i == 2 ? &tok->suffix : &tok->condprefix;
+		*p = strndup(c, format - c);
+		c = format + 1;
+		i++;
+	}
+	p = !tok->tag || i == 0 ? &tok->contents : i == 1 ? &tok->prefix :
+		i == 2 ? &tok->suffix : &tok->condprefix;
+	*p = strndup(c, format - c);
+	return cnt;
+}
+
+static struct format_token *old_parse_format(const char *format) {
+	struct format_token *ret = NULL, **tok = &ret;
+	int i;
+	while (*format) {
+		*tok = malloc(sizeof(**tok));
+		if (!(i = old_get_token(format, *tok))) {
+			free(*tok);
+			*tok = NULL;
+			break;
+		}
+		format += i;
+		tok = &(*tok)->next;
+	}
+	return ret;
+}
+
+static void old_free_format(struct format_token *t) {
+	struct format_token *next;
+	for (; t; t = next) {
+		next = t->next;
+		free(t->contents);
+		free(t->prefix);
+		free(t->suffix);
+		free(t->condprefix);
+		free(t);
+	}
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	struct format_options o = {ESCAPE_NONE, &strings, NULL};
+	struct format_data data = {NULL};
+	struct format_program *prog;
+	struct format_token *tok;
+	double t, told;
+	size_t i, j;
+	int n = 200000, c, r;
+	char *a, *b;
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		if (c != 'n')
+			return fprintf(stderr, "Usage: %s [-n ROUNDS]\n", argv[0]), EXIT_FAILURE;
+		n = atoi(optarg);
+	}
+	data.song = mpd_song_begin(&song_pairs[0]);
+	for (i = 1; i < sizeof(song_pairs) / sizeof(song_pairs[0]); ++i)
+		mpd_song_feed(data.song, &song_pairs[i]);
+	data.status = mpd_status_begin();
+	for (i = 0; i < sizeof(status_pairs) / sizeof(status_pairs[0]); ++i)
+		mpd_status_feed(data.status, &status_pairs[i]);
+	for (i = 0, r = EXIT_SUCCESS; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+		prog = parse_format(formats[i], &o);
+		tok = old_parse_format(formats[i]);
+		format_song(&a, &data, prog);
+		old_format_song(&b, &data, tok);
+		if (strcmp(a, b)) {
+			fprintf(stderr, "%s: '%s' != '%s'\n", formats[i], a, b);
+			r = EXIT_FAILURE;
+		}
+		free(a);
+		free(b);
+		t = now();
+		for (j = 0; j < (size_t) n; ++j) {
+			format_song(&a, &data, prog);
+			free(a);
+		}
+		t = now() - t;
+		told = now();
+		for (j = 0; j < (size_t) n; ++j) {
+			old_format_song(&b, &data, tok);
+			free(b);
+		}
+		told = now() - told;
+		printf("%-52s %7.1f ns  (tokens %7.1f ns)\n", formats[i], t / n, told / n);
+		free_format(prog);
+		old_free_format(tok);
+	}
+	mpd_song_free(data.song);
+	mpd_status_free(data.status);
+	return r;
+}
@@ -0,0 +1,104 @@
+/* Compares the per-event round trip (status and currentsong in one
+ * command list, as mpdsub sends them) over TCP and over a Unix socket.
+ *
+ * Usage: transport-bench [-n ROUNDS] [-h HOST] [-p PORT] [-s SOCKET]
+ * Build: make transport-bench */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <mpd/client.h>
+
+static int cmp(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int bench(const char *name, const char *host, unsigned port, int n) {
+	struct mpd_connection *conn = mpd_connection_new(host, port, 0);
+	struct mpd_status *status;
+	struct mpd_song *song;
+	double *t, start, sum = 0;
+	int i;
+	if (!conn || mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
+		fprintf(stderr, "%s: %s\n", name, conn ?
+			mpd_connection_get_error_message(conn) : "out of memory");
+		if (conn)
+			mpd_connection_free(conn);
+		return -1;
+	}
+	t = malloc(n * sizeof(*t));
+	for (i = 0; i < n; ++i) {
+		start = now();
+		if (!mpd_command_list_begin(conn, true) || !mpd_send_status(conn) ||
+				!mpd_send_current_song(conn) || !mpd_command_list_end(conn) ||
+				!(status = mpd_recv_status(conn)) || !mpd_response_next(conn))
+			break;
+		if ((song = mpd_recv_song(conn)))
+			mpd_song_free(song);
+		mpd_status_free(status);
+		if (!mpd_response_finish(conn))
+			break;
+		sum += t[i] = now() - start;
+	}
+	if (i < n) {
+		fprintf(stderr, "%s: %s\n", name, mpd_connection_get_error_message(conn));
+		free(t);
+		mpd_connection_free(conn);
+		return -1;
+	}
+	qsort(t, n, sizeof(*t), cmp);
+	printf("%-6s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+		t[0], t[n / 2], t[n * 99 / 100], t[n - 1], sum / n);
+	free(t);
+	mpd_connection_free(conn);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	const char *host = "localhost", *sock = NULL, *run;
+	static char path[4096];
+	unsigned port = 6600;
+	int n = 10000, c, res = 0;
+	while ((c = getopt(argc, argv, "n:h:p:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n ROUNDS] [-h HOST] [-p PORT] [-s SOCKET]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (n <= 0)
+		n = 1;
+	if (!sock && (run = getenv("XDG_RUNTIME_DIR")) &&
+			snprintf(path, sizeof(path), "%s/mpd/socket", run) < (int) sizeof(path) &&
+			!access(path, F_OK))
+		sock = path;
+	if (!sock)
+		sock = "/run/mpd/socket";
+	printf("%d round trips, latency in microseconds\n", n);
+	printf("%-6s %10s %10s %10s %10s %10s\n", "", "min", "median", "p99", "max", "mean");
+	res |= bench("tcp", host, port, n);
+	res |= bench("unix", sock, 0, n);
+	return res ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+/* Compares width_truncate with an mbrtowc/wcwidth loop, cutting long
+ * titles in various scripts to a status bar width.
+ *
+ * Checks first that no cut (with its ellipsis) exceeds the width.
+ *
+ * Usage: width-bench [-n ROUNDS] [-w WIDTH]
+ * Build: make width-bench */
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "width.h"
+
+static const char *samples[] = {
+	"Some Fairly Long English Title (Extended Remix) [Remastered 2011 Version] feat. Another Artist",
+	"東京事変 - 群青日和 (2004年 シングル・ヴァージョン) ～ライブ・アット・武道館～ 完全収録盤",
+	"방탄소년단 - 봄날 (You Never Walk Alone 버전) 스페셜 에디션 리마스터드 트랙",
+	"Ἀπόλλων καὶ Μοῦσαι: Ὕμνος εἰς Ἑρμῆν — Ἀρχαία ἑλληνικὴ μουσική, ἀνασύνθεση",
+	"🎵🎶 Party Mix 🎉🎊 — Best of 2023 🔥🔥🔥 (Non-Stop DJ Set) 💃🕺 Extended",
+	"Café Tacvba – Déjà vu naïve façade (Versión en español, año 1999) — Über größte Hits",
+};
+
+static const char *checked[] = {
+	"abcd", "abcdefghijklmnop", "abcdefgh", "ab東京cd", "東京事変群青日和", "a東b京c",
+};
+
+// the cut and its ellipsis fit in max columns, for every max
+static void check(const char *s) {
+	size_t len = strlen(s), k;
+	unsigned max, w;
+	int e;
+	for (max = 1; max <= 20; ++max) {
+		k = width_truncate(s, len, max, &e);
+		width_fit(s, k, -1u, &w);
+		assert(w + (e ? 1 : 0) <= max);
+		assert(e || k == len);
+	}
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// the same cut done with the C library
+static size_t libc_truncate(const char *s, size_t len, unsigned max, int *ellipsis) {
+	mbstate_t st;
+	size_t i = 0, n, cut = 0;
+	unsigned cols = 0;
+	wchar_t wc;
+	int w;
+	memset(&st, 0, sizeof(st));
+	*ellipsis = 0;
+	while (i < len) {
+		n = mbrtowc(&wc, s + i, len - i, &st);
+		if (n == (size_t) -1 || n == (size_t) -2) {
+			memset(&st, 0, sizeof(st));
+			n = 1;
+			w = 1;
+		} else {
+			w = wcwidth(wc);
+			if (w < 0)
+				w = 1;
+		}
+		if (cols + w > max - 1 && !cut)
+			cut = i;
+		if (cols + w > max) {
+			*ellipsis = 1;
+			return cut;
+		}
+		cols += w;
+		i += n;
+	}
+	return i;
+}
+
+int main(int argc, char **argv) {
+	size_t (*impl[])(const char *, size_t, unsigned, int *) = {width_truncate, libc_truncate};
+	const char *names[] = {"width", "libc"};
+	size_t i, j, k, sink = 0, lens[sizeof(samples) / sizeof(samples[0])];
+	unsigned width = 40;
+	int n = 200000, c, e;
+	double t;
+	setlocale(LC_CTYPE, "C.UTF-8");
+	while ((c = getopt(argc, argv, "n:w:")) != -1) {
+		if (c == 'n')
+			n = atoi(optarg);
+		else if (c == 'w')
+			width = atoi(optarg);
+		else
+			return fprintf(stderr, "Usage: %s [-n ROUNDS] [-w WIDTH]\n", argv[0]), EXIT_FAILURE;
+	}
+	for (j = 0; j < sizeof(checked) / sizeof(checked[0]); ++j)
+		check(checked[j]);
+	for (j = 0; j < sizeof(samples) / sizeof(samples[0]); ++j) {
+		check(samples[j]);
+		lens[j] = strlen(samples[j]);
+		k = width_truncate(samples[j], lens[j], width, &e);
+		printf("%.*s%s\n", (int) k, samples[j], e ? ELLIPSIS : "");
+	}
+	for (i = 0; i < sizeof(impl) / sizeof(impl[0]); ++i) {
+		t = now();
+		for (c = 0; c < n; ++c)
+			for (j = 0; j < sizeof(samples) / sizeof(samples[0]); ++j)
+				sink += impl[i](samples[j], lens[j], width, &e);
+		t = now() - t;
+		printf("%-6s %8.1f ns/title\n", names[i], t / n / (sizeof(samples) / sizeof(samples[0])));
+	}
+	return sink == 0;
+}
@@ -0,0 +1,7 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+#include <stdint.h>
+
+// the monotonic clock in microseconds
+uint64_t clock_us(void);
+#endif //CLOCK_H
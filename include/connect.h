@@ -1,6 +1,33 @@
 #ifndef CONNECT_H
 #define CONNECT_H
+#include <stdint.h>
 #include <mpd/client.h>
 
-int connect_mpd(struct mpd_connection **, char *, int, char *);
+#include "message.h"
+
+#define IDLE_WATCHES 4
+
+// called while waiting for idle events, with data
+struct idle_hooks {
+	void *data;
+	// every tick milliseconds, if positive
+	int tick;
+	void (*ticked)(void *data);
+	// readable is called out of idle when fd is readable (unless it is
+	// negative), it may add to the events and returns -1 on connection
+	// errors, 0 to stop watching fd
+	struct idle_watch {
+		int fd;
+		int (*readable)(void *data, struct mpd_connection *, enum mpd_idle *events);
+	} watch[IDLE_WATCHES];
+	unsigned nwatch;
+};
+
+int connect_mpd(struct mpd_connection **, const char *host, int port,
+		const char *password, const struct messages *);
+char *find_socket(void);
+void set_keepalive(struct mpd_connection *, int timeout, const struct messages *);
+enum mpd_idle wait_idle(struct mpd_connection *, enum mpd_idle mask,
+		int interval, uint64_t *alive, struct idle_hooks *,
+		const struct messages *);
 #endif //CONNECT_H
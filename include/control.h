@@ -0,0 +1,24 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+#include <stdio.h>
+
+enum control_command {
+	CONTROL_UNKNOWN,
+	CONTROL_RELOAD,
+	CONTROL_RECONNECT,
+	CONTROL_STATS,
+	CONTROL_SHUTDOWN
+};
+
+struct control_client {
+	int fd;
+	// the reply, sent at once
+	FILE *out;
+	char *buf;
+	size_t len;
+};
+
+int control_listen(const char *path);
+int control_accept(int fd, struct control_client *);
+void control_reply(struct control_client *);
+#endif //CONTROL_H
@@ -0,0 +1,10 @@
+#ifndef COVER_H
+#define COVER_H
+#include <stdbool.h>
+#include <mpd/client.h>
+
+bool cover_init(const char *dir, unsigned long max_size);
+char *cover_fetch(struct mpd_connection *, const char *uri,
+		const char *artist, const char *album);
+void cover_set_current(const char *path);
+#endif //COVER_H
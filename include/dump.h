@@ -0,0 +1,11 @@
+#ifndef DUMP_H
+#define DUMP_H
+#include <stdbool.h>
+#include <mpd/client.h>
+
+#include "formats.h"
+#include "sink.h"
+
+bool dump_db(struct mpd_connection *, struct format_list *, struct sink *,
+		const char *filter, int threads);
+#endif //DUMP_H
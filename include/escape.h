@@ -0,0 +1,21 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+#include <stdbool.h>
+#include <stddef.h>
+
+enum escape {
+	ESCAPE_NONE,
+	ESCAPE_PANGO,
+	ESCAPE_SHELL,
+	ESCAPE_JSON,
+	ESCAPE_CSV,
+	ESCAPE_STRIP,
+	ESCAPE_MODES
+};
+
+int escape_parse(const char *name);
+const char *escape_quote(enum escape);
+bool escape_cuttable(enum escape);
+size_t escape_span(enum escape, const char *s, size_t len);
+const char *escape_byte(enum escape, unsigned char c, char *tmp);
+#endif //ESCAPE_H
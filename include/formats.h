@@ -1,22 +1,67 @@
 #ifndef FORMATS_H
 #define FORMATS_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <mpd/client.h>
 
-struct format_token {
-	bool tag;
-	char *contents, *prefix, *suffix, *condprefix;
-	struct format_token *next;
+#include "escape.h"
+#include "message.h"
+#include "song.h"
+#include "sticker.h"
+
+struct format_program;
+
+// library statistics, refreshed on database changes only
+struct db_stats {
+	bool valid;
+	unsigned songs, artists, albums;
+	unsigned long playtime, uptime;
+	// clock_us() at the refresh
+	uint64_t fetched;
 };
 
-int format_song(char **, struct mpd_song *, struct mpd_status *status, struct format_token *);
+// the song is either a full mpd_song or a partially decoded one
+struct format_data {
+	struct mpd_song *song, *next;
+	struct mpd_status *status;
+	struct song_slots *slots;
+	const char *cover;
+	const struct stickers *stickers;
+	const struct db_stats *db;
+};
 
-struct format_token *parse_format(char *format);
+struct format_list {
+	struct format_program *prog;
+	struct format_list *next;
+};
 
-extern struct format_strings {
+// the values of the state tag
+struct format_strings {
 	char *play;
 	char *stop;
 	char *pause;
 	char *unknown;
-} strings;
+};
+
+// strings is referenced (not copied) by the compiled programs, and the
+// defaults are used when it is NULL
+struct format_options {
+	enum escape escape;
+	const struct format_strings *strings;
+	const struct messages *log;
+};
+
+int format_song(char **, struct format_data *, struct format_program *);
+char *render_song(struct format_list *, struct format_data *);
+const char *format_data_tag(struct format_data *, enum mpd_tag_type);
+const char *format_data_uri(struct format_data *);
+
+struct format_program *parse_format(const char *format, const struct format_options *);
+void free_format(struct format_program *);
+void compile_formats(struct format_list *, const char *format,
+		const struct format_options *);
+void free_formats(struct format_list *);
+void format_tags(struct format_list *, bool *wanted);
+bool format_stickers(struct format_list *);
+bool format_db_stats(struct format_list *);
 #endif //FORMATS_H
@@ -0,0 +1,27 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+#include <stdbool.h>
+#include <stdint.h>
+
+enum history_tag {
+	HISTORY_ARTIST,
+	HISTORY_ALBUM_ARTIST,
+	HISTORY_ALBUM,
+	HISTORY_TITLE,
+	HISTORY_NAME,
+	HISTORY_URI,
+	HISTORY_TAGS
+};
+
+struct history_item {
+	int64_t time;
+	unsigned id, duration;
+	const char *tags[HISTORY_TAGS];
+};
+
+bool history_open(const char *path);
+bool history_append(const struct history_item *);
+int history_query(const char *path, int64_t from, int64_t to,
+		void (*cb)(void *, const struct history_item *), void *ctx);
+bool history_parse_time(const char *, int64_t *);
+#endif //HISTORY_H
@@ -0,0 +1,12 @@
+#ifndef I3BAR_H
+#define I3BAR_H
+#include <stdbool.h>
+#include <mpd/client.h>
+
+#include "sink.h"
+
+void i3bar_init(struct sink *, bool markup);
+bool i3bar_bind(unsigned button, const char *command);
+void i3bar_write(struct sink *, const char *line);
+int i3bar_click(struct mpd_connection *);
+#endif //I3BAR_H
@@ -0,0 +1,13 @@
+#ifndef LISTEN_H
+#define LISTEN_H
+#include <stdbool.h>
+
+struct listen_song {
+	int id;
+	const char *artist, *album_artist, *album, *title;
+};
+
+bool listen_init(const char *path, int interval, unsigned max);
+void listen_update(bool playing, const struct listen_song *);
+int listen_snapshot(void);
+#endif //LISTEN_H
@@ -0,0 +1,8 @@
+#ifndef MARQUEE_H
+#define MARQUEE_H
+#include <stdbool.h>
+
+void marquee_init(unsigned width);
+bool marquee_set(const char *line);
+const char *marquee_next(void);
+#endif //MARQUEE_H
@@ -0,0 +1,13 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+// where the library reports problems, stderr if there is no sink or print
+struct messages {
+	// the message comes without a trailing newline
+	void (*print)(void *data, const char *message);
+	void *data;
+};
+
+void message(const struct messages *, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+#endif //MESSAGE_H
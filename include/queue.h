@@ -0,0 +1,11 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+#include <stdbool.h>
+#include <mpd/client.h>
+
+void queue_init(unsigned length);
+void queue_reset(void);
+int queue_update(struct mpd_connection *, struct mpd_status *);
+unsigned queue_window(void);
+struct mpd_song *queue_entry(unsigned i);
+#endif //QUEUE_H
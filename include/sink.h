@@ -0,0 +1,31 @@
+#ifndef SINK_H
+#define SINK_H
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "escape.h"
+
+struct sink {
+	char *path;
+	FILE *file;
+	bool overwrite;
+	// how tag values in its lines are escaped
+	enum escape escape;
+	// display columns each line is truncated to, 0 for no limit
+	unsigned max_width;
+	// rotated once it grows past max_size bytes, keeping count old files
+	long max_size;
+	int count;
+	// flushed every flush_lines lines and/or flush_interval seconds after
+	// the first unflushed one (every line if neither is set)
+	int flush_lines, flush_interval;
+	bool fsync;
+	long size;
+	int pending;
+};
+
+bool sink_open(struct sink *);
+void sink_write(struct sink *, const char *);
+void sink_flush(struct sink *);
+void sink_flush_all(void);
+#endif //SINK_H
@@ -0,0 +1,26 @@
+#ifndef SONG_H
+#define SONG_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <mpd/client.h>
+
+#define SONG_BUF_SIZE 4096
+
+/* A song decoded straight from the protocol pairs, keeping only the
+ * wanted tags. Values are stored in a fixed buffer which is reused for
+ * every song, tags[t] is the offset of tag t in it plus one (0 if unset). */
+struct song_slots {
+	bool wanted[MPD_TAG_COUNT];
+	bool valid;
+	unsigned id, pos, duration;
+	unsigned short uri, tags[MPD_TAG_COUNT];
+	size_t used;
+	char buf[SONG_BUF_SIZE];
+};
+
+bool song_slots_recv(struct mpd_connection *, struct song_slots *);
+void song_slots_set(struct song_slots *, const char *uri, const char *const *tags,
+		const enum mpd_tag_type *types, size_t n);
+const char *song_slots_tag(const struct song_slots *, enum mpd_tag_type);
+const char *song_slots_uri(const struct song_slots *);
+#endif //SONG_H
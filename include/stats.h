@@ -0,0 +1,34 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum stats_phase {
+	STATS_IDLE,
+	STATS_STATUS,
+	STATS_SONG,
+	STATS_RENDER,
+	STATS_WRITE,
+	STATS_EVENT,
+	STATS_CONNECT,
+	STATS_PHASES
+};
+
+extern bool stats_enabled;
+
+uint64_t stats_clock(void);
+void stats_record(enum stats_phase, uint64_t start);
+void stats_write(FILE *);
+int stats_dump(const char *path);
+
+// both are no-ops (besides a branch) unless stats are enabled
+static inline uint64_t stats_begin(void) {
+	return stats_enabled ? stats_clock() : 0;
+}
+
+static inline void stats_end(enum stats_phase phase, uint64_t start) {
+	if (stats_enabled)
+		stats_record(phase, start);
+}
+#endif //STATS_H
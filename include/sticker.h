@@ -0,0 +1,25 @@
+#ifndef STICKER_H
+#define STICKER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <mpd/client.h>
+
+#define STICKER_BUCKETS 512
+
+struct stickers;
+
+// the stickers of recently played songs, zeroed before use
+struct sticker_cache {
+	struct stickers *head, *tail, *buckets[STICKER_BUCKETS];
+	unsigned count;
+	// the lookup queued in the command list being sent
+	char *pending;
+};
+
+bool stickers_send(struct sticker_cache *, struct mpd_connection *, const char *uri);
+bool stickers_recv(struct sticker_cache *, struct mpd_connection *);
+const struct stickers *stickers_fetch(struct sticker_cache *, struct mpd_connection *,
+		const char *uri);
+const char *stickers_value(const struct stickers *, const char *name, size_t len);
+void stickers_invalidate(struct sticker_cache *);
+#endif //STICKER_H
@@ -0,0 +1,14 @@
+#ifndef TRACE_H
+#define TRACE_H
+/* USDT probes under the "mpdsub" provider, nops unless traced.
+ * Compiled out entirely when sys/sdt.h is not available. */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define trace(...) STAP_PROBEV(mpdsub, __VA_ARGS__)
+#else
+static inline void trace_nop(int dummy, ...) {
+	(void) dummy;
+}
+#define trace(probe, ...) trace_nop(0, ##__VA_ARGS__)
+#endif
+#endif //TRACE_H
@@ -0,0 +1,7 @@
+#ifndef WATCH_H
+#define WATCH_H
+#include <stddef.h>
+
+int watch_files(char *const *paths, size_t n);
+int watch_changed(int fd);
+#endif //WATCH_H
@@ -0,0 +1,12 @@
+#ifndef WIDTH_H
+#define WIDTH_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define ELLIPSIS "\xe2\x80\xa6"
+
+unsigned width_char(uint32_t cp);
+size_t width_fit(const char *s, size_t len, unsigned max, unsigned *w);
+size_t width_truncate(const char *s, size_t len, unsigned max, int *ellipsis);
+size_t width_next(const char *s, size_t len, unsigned *w);
+#endif //WIDTH_H
@@ -0,0 +1,11 @@
+#include <stdint.h>
+
+#include <time.h>
+
+#include "clock.h"
+
+uint64_t clock_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
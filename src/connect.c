@@ -1,15 +1,31 @@
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
 #include <mpd/client.h>
 
-#include "util.h"
+#include "clock.h"
+#include "connect.h"
+#include "message.h"
 
-bool supported_protocol(struct mpd_connection *);
-bool authorized(struct mpd_connection *);
-int connect_mpd(struct mpd_connection **, char *, int, char *);
+static bool supported_protocol(struct mpd_connection *);
+static bool authorized(struct mpd_connection *);
+int connect_mpd(struct mpd_connection **, const char *, int, const char *,
+		const struct messages *);
+void set_keepalive(struct mpd_connection *, int, const struct messages *);
+char *find_socket(void);
+enum mpd_idle wait_idle(struct mpd_connection *, enum mpd_idle, int, uint64_t *,
+		struct idle_hooks *, const struct messages *);
+static int wait_readable(struct pollfd *, nfds_t, int);
+static int wait_ticking(struct pollfd *, nfds_t, int, struct idle_hooks *);
 
 bool authorized(struct mpd_connection *conn) {
 	int perms = 0;
@@ -49,36 +65,174 @@ recv:
 	return cmds == 7;
 }
 
-int connect_mpd(struct mpd_connection **c, char *host, int port, char *password) {
+int connect_mpd(struct mpd_connection **c, const char *host, int port,
+		const char *password, const struct messages *m) {
 	struct mpd_connection *conn;
 	conn = mpd_connection_new(host, port, 0);
 	if (!conn)
 		return -1;
 	if (mpd_connection_get_error(conn) == MPD_ERROR_SUCCESS) {
 		*c = conn;
-		log("Connected to mpd instance at %s\n", host);
+		message(m, "Connected to mpd instance at %s", host);
 		if (!supported_protocol(conn)) {
-			log("mpd instance does not support all required features.\n");
+			message(m, "mpd instance does not support all required features.");
 			return -1;
 		}
 		if (!authorized(conn)) {
 			if (!password) {
-				log("Password required.\n");
+				message(m, "Password required.");
 				return -1;
 			}
 			if (!mpd_run_password(conn, password)) {
-				log("Invalid password provided.\n");
+				message(m, "Invalid password provided.");
 				return -1;
 			}
 			if (!authorized(conn)) {
-				log("Insufficient permissions (read required).\n");
+				message(m, "Insufficient permissions (read required).");
 				return -1;
 			}
 		}
 	} else {
-		log("Could not connect to mpd instance: %s\n",
+		message(m, "Could not connect to mpd instance: %s",
 			mpd_connection_get_error_message(conn));
+		mpd_connection_free(conn);
 		return 0;
 	}
 	return 1;
 }
+
+// makes the kernel drop a TCP connection to an unresponsive host within
+// about timeout seconds, whether it is idle or has unacknowledged data
+void set_keepalive(struct mpd_connection *conn, int timeout,
+		const struct messages *m) {
+	int fd = mpd_connection_get_fd(conn), on = 1, idle, intvl, cnt = 3;
+	unsigned user = timeout * 1000;
+	struct sockaddr_storage sa;
+	socklen_t len = sizeof(sa);
+	if (timeout <= 0 || getsockname(fd, (struct sockaddr *) &sa, &len) ||
+			(sa.ss_family != AF_INET && sa.ss_family != AF_INET6))
+		return;
+	idle = timeout / 2 > 0 ? timeout / 2 : 1;
+	intvl = (timeout - idle) / cnt > 0 ? (timeout - idle) / cnt : 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) ||
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) ||
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) ||
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) ||
+			setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user, sizeof(user)))
+		message(m, "Could not enable TCP keepalive: %s", strerror(errno));
+}
+
+/* Waits for idle events. With a probe interval, the server is sent a
+ * noidle after that many seconds without events, which it has to answer
+ * within as many seconds. The hooks' ticked is called every tick
+ * milliseconds while waiting, and the watches are called whenever their
+ * fd is readable, once out of idle so that they can run commands. Returns
+ * 0 on errors (the connection is left in the error state) or when a probe
+ * is not answered, alive is set to the time (clock_us()) of each
+ * reply. */
+enum mpd_idle wait_idle(struct mpd_connection *conn, enum mpd_idle mask,
+		int interval, uint64_t *alive, struct idle_hooks *h,
+		const struct messages *m) {
+	struct pollfd pfd[1 + IDLE_WATCHES] = {
+		{.fd = mpd_connection_get_fd(conn), .events = POLLIN}
+	};
+	enum mpd_idle events;
+	bool watched = false;
+	nfds_t n = 1, i;
+	int r;
+	for (i = 0; h && i < h->nwatch; ++i, ++n) {
+		pfd[n].fd = h->watch[i].fd;
+		pfd[n].events = POLLIN;
+		watched |= pfd[n].fd >= 0;
+	}
+	if (interval <= 0 && (!h || h->tick <= 0) && !watched) {
+		if ((events = mpd_run_idle_mask(conn, mask)))
+			*alive = clock_us();
+		return events;
+	}
+	// a probe reply comes without events, idle again then
+	do {
+		if (!mpd_send_idle_mask(conn, mask))
+			return 0;
+		r = wait_ticking(pfd, n, interval, h);
+		// a probe, or leaving idle for the watches
+		if (!r || (r > 0 && !pfd[0].revents)) {
+			if (!mpd_send_noidle(conn))
+				return 0;
+			if (!(r = wait_readable(pfd, 1, interval))) {
+				message(m, "No reply to a probe within %ds.", interval);
+				return 0;
+			}
+		}
+		if (r < 0) {
+			message(m, "Could not wait for mpd: %s", strerror(errno));
+			return 0;
+		}
+		events = mpd_recv_idle(conn, true);
+		if (!mpd_response_finish(conn))
+			return 0;
+		*alive = clock_us();
+		for (i = 1; i < n; ++i) {
+			if (!pfd[i].revents)
+				continue;
+			if ((r = h->watch[i - 1].readable(h->data, conn, &events)) < 0)
+				return 0;
+			if (!r)
+				pfd[i].fd = h->watch[i - 1].fd = -1;
+			pfd[i].revents = 0;
+		}
+	} while (!events);
+	return events;
+}
+
+// returns the first of the standard local socket locations that exists
+char *find_socket() {
+	const char *run = getenv("XDG_RUNTIME_DIR");
+	struct stat st;
+	size_t len;
+	char *path;
+	if (run && *run) {
+		len = strlen(run) + sizeof("/mpd/socket");
+		path = malloc(len);
+		snprintf(path, len, "%s/mpd/socket", run);
+		if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+			return path;
+		free(path);
+	}
+	if (!stat("/run/mpd/socket", &st) && S_ISSOCK(st.st_mode))
+		return strdup("/run/mpd/socket");
+	return NULL;
+}
+
+// a handled signal (e.g. SIGALRM for interval flushes) restarts the wait,
+// which is endless if interval is not positive
+int wait_readable(struct pollfd *pfd, nfds_t n, int interval) {
+	int r;
+	while ((r = poll(pfd, n, interval > 0 ? interval * 1000 : -1)) < 0 &&
+			errno == EINTR);
+	return r;
+}
+
+// waits up to interval seconds (forever if not positive), calling the
+// hooks' ticked every tick milliseconds meanwhile
+int wait_ticking(struct pollfd *pfd, nfds_t n, int interval,
+		struct idle_hooks *h) {
+	uint64_t now, end = clock_us() + (uint64_t) interval * 1000000;
+	int r, ms;
+	if (!h || h->tick <= 0)
+		return wait_readable(pfd, n, interval);
+	while (1) {
+		ms = h->tick;
+		if (interval > 0) {
+			if ((now = clock_us()) >= end)
+				return 0;
+			if ((end - now) / 1000 < (uint64_t) h->tick)
+				ms = (end - now) / 1000 + 1;
+		}
+		while ((r = poll(pfd, n, ms)) < 0 && errno == EINTR);
+		if (r)
+			return r;
+		if (ms == h->tick)
+			h->ticked(h->data);
+	}
+}
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "util.h"
+
+/* The control socket takes one command line per connection and replies
+ * before closing it, e.g. `echo reload | nc -U PATH`. Clients are served
+ * between idle events, one at a time. */
+
+// how long a client has to send its command
+#define CLIENT_TIMEOUT 1000
+
+static const char *commands[] = {
+	[CONTROL_RELOAD] = "reload",
+	[CONTROL_RECONNECT] = "reconnect",
+	[CONTROL_STATS] = "stats",
+	[CONTROL_SHUTDOWN] = "shutdown",
+};
+
+// returns the listening socket at path, -1 on errors or if it is in use
+int control_listen(const char *path) {
+	struct sockaddr_un sa = {.sun_family = AF_UNIX};
+	struct stat st;
+	mode_t mask;
+	int fd, r;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		log("Control socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+	// anything else at path is left alone
+	if (!lstat(path, &st) && !S_ISSOCK(st.st_mode)) {
+		log("%s exists and is not a socket.\n", path);
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		perror("Could not create the control socket");
+		return -1;
+	}
+	// a socket nobody listens on is left over from a previous instance
+	if (!connect(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+		log("Control socket %s is in use.\n", path);
+		close(fd);
+		return -1;
+	}
+	// e.g. EAGAIN, a live instance with a full backlog
+	if (errno != ECONNREFUSED && errno != ENOENT) {
+		log("%s: ", path);
+		perror("Could not probe the control socket");
+		close(fd);
+		return -1;
+	}
+	if (errno == ECONNREFUSED)
+		unlink(path);
+	// only the user may connect, from the moment the socket exists
+	mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+	r = bind(fd, (struct sockaddr *) &sa, sizeof(sa));
+	umask(mask);
+	if (r || listen(fd, 4)) {
+		perror("Could not listen on the control socket");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Accepts a pending client and reads its command, the reply is to be
+ * written to the client's out, then sent with control_reply. Returns -1
+ * once no client is pending. */
+int control_accept(int fd, struct control_client *client) {
+	struct timeval tv = {CLIENT_TIMEOUT / 1000, CLIENT_TIMEOUT % 1000 * 1000};
+	char line[64];
+	size_t i, len;
+	ssize_t n;
+	int c;
+	while (1) {
+		if ((c = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("Could not accept a control client");
+			return -1;
+		}
+		// a slow client only delays the next event that long
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		for (len = 0; len < sizeof(line) - 1 && !memchr(line, '\n', len); len += n)
+			if ((n = read(c, line + len, sizeof(line) - 1 - len)) <= 0)
+				break;
+		line[len] = 0;
+		line[strcspn(line, "\r\n")] = 0;
+		client->fd = c;
+		if (!(client->out = open_memstream(&client->buf, &client->len))) {
+			close(c);
+			continue;
+		}
+		for (i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
+			if (commands[i] && !strcasecmp(line, commands[i]))
+				return i;
+		return CONTROL_UNKNOWN;
+	}
+}
+
+// sends the reply and closes the connection, a client gone is no SIGPIPE
+void control_reply(struct control_client *client) {
+	size_t off = 0;
+	ssize_t n;
+	fclose(client->out);
+	while (off < client->len &&
+			(n = send(client->fd, client->buf + off, client->len - off,
+				MSG_NOSIGNAL)) > 0)
+		off += n;
+	free(client->buf);
+	close(client->fd);
+}
@@ -0,0 +1,275 @@
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mpd/client.h>
+
+#include "cover.h"
+#include "util.h"
+
+/* Album art is cached in a directory, one file per album, named after a
+ * hash of the album identity. It is streamed from mpd (albumart, then
+ * readpicture) chunk by chunk into the cache, hits skip the transfer.
+ * File mtimes are bumped on hits, and the least recently used files are
+ * evicted once the directory grows past its size limit. */
+
+#define CHUNK_SIZE 8192
+#define MISSING_KEYS 16
+
+static const struct {
+	const char *ext, *magic;
+	size_t len;
+} types[] = {
+	{"jpg",		"\xff\xd8\xff",	3},
+	{"png",		"\x89PNG",	4},
+	{"gif",		"GIF8",		4},
+	{"webp",	"RIFF",		4},
+	{"bin",		"",		0},
+};
+
+static struct {
+	char *dir, *link, *partial, *current;
+	unsigned long max_size;
+	// recent albums known to have no art
+	uint64_t missing[MISSING_KEYS];
+	unsigned nmissing;
+} cache;
+
+static uint64_t album_key(const char *uri, const char *artist, const char *album);
+static char *entry_path(uint64_t key, const char *ext);
+static char *lookup(uint64_t key);
+static long transfer(struct mpd_connection *, const char *cmd, const char *uri, int fd);
+static const char *sniff(int fd);
+static void evict(void);
+
+bool cover_init(const char *dir, unsigned long max_size) {
+	size_t len = strlen(dir) + 16;
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		log("%s: ", dir);
+		perror("Could not create the cover cache directory");
+		return false;
+	}
+	cache.dir = strdup(dir);
+	cache.max_size = max_size;
+	cache.link = malloc(len);
+	snprintf(cache.link, len, "%s/current", dir);
+	cache.partial = malloc(len);
+	snprintf(cache.partial, len, "%s/.partial", dir);
+	return true;
+}
+
+// returns the cached art path (to be freed), NULL if the song has no art
+// or on errors, the connection is left in the error state for the caller
+char *cover_fetch(struct mpd_connection *conn, const char *uri,
+		const char *artist, const char *album) {
+	uint64_t key;
+	unsigned i;
+	long n;
+	int fd;
+	char *path;
+	if (!uri)
+		return NULL;
+	key = album_key(uri, artist, album);
+	if ((path = lookup(key)))
+		return path;
+	for (i = 0; i < cache.nmissing && i < MISSING_KEYS; ++i)
+		if (cache.missing[i] == key)
+			return NULL;
+	if ((fd = open(cache.partial, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("Could not open cover cache file");
+		return NULL;
+	}
+	if (!(n = transfer(conn, "albumart", uri, fd)) && !ftruncate(fd, 0))
+		n = transfer(conn, "readpicture", uri, fd);
+	if (n <= 0) {
+		close(fd);
+		unlink(cache.partial);
+		if (!n)
+			cache.missing[cache.nmissing++ % MISSING_KEYS] = key;
+		return NULL;
+	}
+	path = entry_path(key, sniff(fd));
+	close(fd);
+	if (rename(cache.partial, path)) {
+		perror("Could not store cover");
+		unlink(cache.partial);
+		free(path);
+		return NULL;
+	}
+	evict();
+	return path;
+}
+
+// points the stable link at the current art, removes it if there is none
+void cover_set_current(const char *path) {
+	size_t len;
+	char *tmp;
+	if (path == cache.current || (path && cache.current && !strcmp(path, cache.current)))
+		return;
+	free(cache.current);
+	cache.current = path ? strdup(path) : NULL;
+	if (!path) {
+		unlink(cache.link);
+		return;
+	}
+	len = strlen(cache.link) + 5;
+	tmp = malloc(len);
+	snprintf(tmp, len, "%s.tmp", cache.link);
+	unlink(tmp);
+	if (symlink(path, tmp) || rename(tmp, cache.link)) {
+		perror("Could not update the current cover link");
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+// FNV-1a over the album artist and album, or the directory without an album
+uint64_t album_key(const char *uri, const char *artist, const char *album) {
+	uint64_t h = 0xcbf29ce484222325;
+	const char *c, *end;
+	if (album) {
+		for (c = artist ? artist : ""; *c; ++c)
+			h = (h ^ (unsigned char) *c) * 0x100000001b3;
+		h = (h ^ 0xff) * 0x100000001b3;
+		for (c = album; *c; ++c)
+			h = (h ^ (unsigned char) *c) * 0x100000001b3;
+	} else {
+		end = strrchr(uri, '/');
+		for (c = uri; c < (end ? end : uri); ++c)
+			h = (h ^ (unsigned char) *c) * 0x100000001b3;
+		h = (h ^ 0xfe) * 0x100000001b3;
+	}
+	return h;
+}
+
+char *entry_path(uint64_t key, const char *ext) {
+	size_t len = strlen(cache.dir) + strlen(ext) + 19;
+	char *path = malloc(len);
+	snprintf(path, len, "%s/%016" PRIx64 ".%s", cache.dir, key, ext);
+	return path;
+}
+
+char *lookup(uint64_t key) {
+	size_t i;
+	char *path;
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+		path = entry_path(key, types[i].ext);
+		if (!utimensat(AT_FDCWD, path, NULL, 0))
+			return path;
+		free(path);
+	}
+	return NULL;
+}
+
+// streams the art into fd, returns its size, 0 if there is none, -1 on errors
+long transfer(struct mpd_connection *conn, const char *cmd, const char *uri, int fd) {
+	struct mpd_pair *pair;
+	unsigned long offset = 0, size = 0, chunk, n, start;
+	bool binary, failed = false;
+	char buf[CHUNK_SIZE], off[24];
+	do {
+		start = offset;
+		snprintf(off, sizeof(off), "%lu", offset);
+		if (!mpd_send_command(conn, cmd, uri, off, NULL))
+			return -1;
+		chunk = 0;
+		binary = false;
+		while (!binary && (pair = mpd_recv_pair(conn))) {
+			if (!strcmp(pair->name, "size"))
+				size = strtoul(pair->value, NULL, 10);
+			else if ((binary = !strcmp(pair->name, "binary")))
+				chunk = strtoul(pair->value, NULL, 10);
+			mpd_return_pair(conn, pair);
+		}
+		for (; binary && chunk; chunk -= n, offset += n) {
+			n = chunk < CHUNK_SIZE ? chunk : CHUNK_SIZE;
+			if (!mpd_recv_binary(conn, buf, n))
+				return -1;
+			// keep draining the response even if the cache is not writable
+			if (!failed && write(fd, buf, n) != (ssize_t) n) {
+				perror("Could not write cover");
+				failed = true;
+			}
+		}
+		if (!mpd_response_finish(conn)) {
+			// no art for the song (or an mpd without the command)
+			if (mpd_connection_get_error(conn) == MPD_ERROR_SERVER &&
+					mpd_connection_clear_error(conn))
+				return 0;
+			return -1;
+		}
+		// an empty chunk ends the data, even short of its size
+	} while (binary && offset > start && offset < size);
+	return failed || !binary ? 0 : (long) offset;
+}
+
+const char *sniff(int fd) {
+	char magic[4];
+	ssize_t n = pread(fd, magic, sizeof(magic), 0);
+	size_t i;
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+		if (n >= (ssize_t) types[i].len && !memcmp(magic, types[i].magic, types[i].len))
+			return types[i].ext;
+	return "bin";
+}
+
+struct entry {
+	char *name;
+	off_t size;
+	struct timespec mtime;
+};
+
+static int by_mtime(const void *a, const void *b) {
+	const struct timespec *x = &((const struct entry *) a)->mtime,
+		*y = &((const struct entry *) b)->mtime;
+	if (x->tv_sec != y->tv_sec)
+		return x->tv_sec < y->tv_sec ? -1 : 1;
+	return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// removes the least recently used entries while over the size limit, the
+// current song's art (which prefetching may make older) is kept
+void evict() {
+	struct entry *entries = NULL;
+	struct dirent *e;
+	struct stat st;
+	size_t n = 0, cap = 0, i;
+	unsigned long long total = 0;
+	const char *current = cache.current ? strrchr(cache.current, '/') + 1 : NULL;
+	DIR *d;
+	if (!cache.max_size || !(d = opendir(cache.dir)))
+		return;
+	while ((e = readdir(d))) {
+		if (*e->d_name == '.' || !strcmp(e->d_name, "current") ||
+				fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+				!S_ISREG(st.st_mode))
+			continue;
+		total += st.st_size;
+		if (current && !strcmp(e->d_name, current))
+			continue;
+		if (n == cap)
+			entries = realloc(entries, (cap = cap ? cap * 2 : 64) * sizeof(*entries));
+		entries[n].name = strdup(e->d_name);
+		entries[n].size = st.st_size;
+		entries[n++].mtime = st.st_mtim;
+	}
+	if (total > cache.max_size)
+		qsort(entries, n, sizeof(*entries), by_mtime);
+	// the newest entry is kept even if it alone exceeds the limit
+	for (i = 0; i + 1 < n && total > cache.max_size; ++i)
+		if (!unlinkat(dirfd(d), entries[i].name, 0))
+			total -= entries[i].size;
+	for (i = 0; i < n; ++i)
+		free(entries[i].name);
+	free(entries);
+	closedir(d);
+}
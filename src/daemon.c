@@ -4,17 +4,22 @@
 #include <stdlib.h>
 
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "daemon.h"
 #include "util.h"
 
+static int pidfd_open_pid(pid_t);
+static int pidfd_kill(int, int);
+static void wait_exit(pid_t, int);
+
 void kill_instance(char *pidfile, bool fatal) {
-	int pid = 0;
-	struct timespec sl = {0, 50000000};
+	int pid = 0, fd = -1;
 	FILE *f;
 	if (!pidfile) {
 		log("Pidfile not specified!\n");
@@ -31,16 +36,25 @@ void kill_instance(char *pidfile, bool fatal) {
 		if (fatal) goto fail;
 		else goto pidf_cleanup;
 	}
-	if (kill(pid, SIGTERM)) {
+	// signalled through a pidfd, a reused pid cannot be mistaken for it
+	if ((fd = pidfd_open_pid(pid)) < 0 && errno != ENOSYS) {
 		printf("%d\n", pid);
 		perror("Could not kill specified process");
 		if (fatal) goto fail;
 		else goto pidf_cleanup;
 	}
-	if (!fatal) {
-		while (kill(pid, 0) != -1 && errno != ESRCH)
-			nanosleep(&sl, NULL);
+	if (fd >= 0 ? pidfd_kill(fd, SIGTERM) : kill(pid, SIGTERM)) {
+		printf("%d\n", pid);
+		perror("Could not kill specified process");
+		if (fd >= 0)
+			close(fd);
+		if (fatal) goto fail;
+		else goto pidf_cleanup;
 	}
+	if (!fatal)
+		wait_exit(pid, fd);
+	if (fd >= 0)
+		close(fd);
 	log("Killed instance running at pid %d successfully.\n", pid);
 	if (fatal)
 		exit(EXIT_SUCCESS);
@@ -56,6 +70,40 @@ pidf_cleanup:
 		unlink(pidfile);
 }
 
+int pidfd_open_pid(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void) pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int pidfd_kill(int fd, int sig) {
+#ifdef SYS_pidfd_send_signal
+	return syscall(SYS_pidfd_send_signal, fd, sig, NULL, 0);
+#else
+	(void) fd;
+	(void) sig;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+// a pidfd is readable as soon as the process exits, polling its pid is the
+// fallback on kernels without pidfds
+void wait_exit(pid_t pid, int fd) {
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	struct timespec sl = {0, 50000000};
+	if (fd >= 0) {
+		while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+		return;
+	}
+	while (kill(pid, 0) != -1 && errno != ESRCH)
+		nanosleep(&sl, NULL);
+}
+
 void daemonize(char **pidfile, char *logfile) {
 	pid_t pid;
 	FILE *f;
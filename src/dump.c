@@ -0,0 +1,200 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpd/client.h>
+
+#include "dump.h"
+#include "stats.h"
+#include "util.h"
+
+// entries in flight between the receiving, formatting and writing threads
+#define RING_SIZE 1024
+
+/* With worker threads, songs are put into a ring in the order they are
+ * received, formatted by whichever worker claims them and written out
+ * strictly in ring order, which keeps memory bounded by the ring size. */
+static struct {
+	struct slot {
+		struct mpd_song *song;
+		char *out;
+	} slots[RING_SIZE];
+	unsigned long head, claim, tail;
+	bool done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct format_list *formats;
+	struct mpd_status *status;
+	struct sink *out;
+} ring = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static void emit(struct mpd_song *, bool threaded);
+static void *worker(void *);
+static void *writer(void *);
+static bool start_threads(pthread_t *, int);
+
+bool dump_db(struct mpd_connection *conn, struct format_list *formats,
+		struct sink *out, const char *filter, int threads) {
+	struct mpd_pair *pair;
+	struct mpd_song *song = NULL;
+	pthread_t *tids = NULL;
+	unsigned long cnt = 0;
+	uint64_t t = stats_clock(), d;
+	bool res;
+	int i;
+	ring.formats = formats;
+	ring.out = out;
+	if (!(ring.status = mpd_run_status(conn)))
+		return false;
+	if (filter) {
+		res = mpd_search_db_songs(conn, false) &&
+			mpd_search_add_expression(conn, filter) &&
+			mpd_search_commit(conn);
+	} else {
+		res = mpd_send_list_all_meta(conn, "");
+	}
+	if (!res)
+		goto out;
+	if (threads > 1) {
+		tids = calloc(threads + 1, sizeof(pthread_t));
+		if (!start_threads(tids, threads)) {
+			log("Could not start worker threads, dumping serially.\n");
+			free(tids);
+			tids = NULL;
+		}
+	}
+	// songs are built from the pairs as they arrive, directories and
+	// playlists are skipped
+	while ((pair = mpd_recv_pair(conn))) {
+		if (!song || !mpd_song_feed(song, pair)) {
+			if (song) {
+				emit(song, tids != NULL);
+				cnt++;
+			}
+			song = strcmp(pair->name, "file") ? NULL : mpd_song_begin(pair);
+		}
+		mpd_return_pair(conn, pair);
+	}
+	if (song) {
+		emit(song, tids != NULL);
+		cnt++;
+	}
+	res = mpd_response_finish(conn);
+	if (tids) {
+		pthread_mutex_lock(&ring.lock);
+		ring.done = true;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+		for (i = 0; i <= threads; ++i)
+			pthread_join(tids[i], NULL);
+		free(tids);
+	}
+	fflush(out->file);
+	d = stats_clock() - t;
+	log("Dumped %lu entries in %.2fs (%.0f entries/s).\n", cnt,
+		d / 1e6, d ? cnt * 1e6 / d : 0.0);
+out:
+	mpd_status_free(ring.status);
+	return res;
+}
+
+void emit(struct mpd_song *song, bool threaded) {
+	struct format_data data = {.song = song, .status = ring.status};
+	struct slot *s;
+	char *c;
+	if (!threaded) {
+		c = render_song(ring.formats, &data);
+		fprintf(ring.out->file, "%s\n", c);
+		free(c);
+		mpd_song_free(song);
+		return;
+	}
+	pthread_mutex_lock(&ring.lock);
+	while (ring.head - ring.tail == RING_SIZE)
+		pthread_cond_wait(&ring.cond, &ring.lock);
+	s = &ring.slots[ring.head++ % RING_SIZE];
+	s->song = song;
+	s->out = NULL;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+void *worker(void *arg) {
+	struct format_data data = {.status = ring.status};
+	struct slot *s;
+	char *c;
+	(void) arg;
+	pthread_mutex_lock(&ring.lock);
+	while (1) {
+		while (ring.claim == ring.head && !ring.done)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		if (ring.claim == ring.head)
+			break;
+		s = &ring.slots[ring.claim++ % RING_SIZE];
+		pthread_mutex_unlock(&ring.lock);
+		data.song = s->song;
+		c = render_song(ring.formats, &data);
+		mpd_song_free(s->song);
+		pthread_mutex_lock(&ring.lock);
+		s->song = NULL;
+		s->out = c;
+		pthread_cond_broadcast(&ring.cond);
+	}
+	pthread_mutex_unlock(&ring.lock);
+	return NULL;
+}
+
+void *writer(void *arg) {
+	struct slot *s;
+	char *c;
+	(void) arg;
+	pthread_mutex_lock(&ring.lock);
+	while (1) {
+		s = &ring.slots[ring.tail % RING_SIZE];
+		while (!(ring.tail != ring.head && s->out) &&
+				!(ring.done && ring.tail == ring.head))
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		if (ring.tail == ring.head)
+			break;
+		c = s->out;
+		s->out = NULL;
+		ring.tail++;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+		fprintf(ring.out->file, "%s\n", c);
+		free(c);
+		pthread_mutex_lock(&ring.lock);
+	}
+	pthread_mutex_unlock(&ring.lock);
+	return NULL;
+}
+
+// starts the workers and the writer, with signals left to the main thread
+bool start_threads(pthread_t *tids, int threads) {
+	sigset_t all, orig;
+	int i;
+	bool res = true;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &orig);
+	if (pthread_create(&tids[threads], NULL, writer, NULL))
+		res = false;
+	for (i = 0; res && i < threads; ++i) {
+		if (pthread_create(&tids[i], NULL, worker, NULL)) {
+			// the started workers exit once the ring is done
+			pthread_mutex_lock(&ring.lock);
+			ring.done = true;
+			pthread_cond_broadcast(&ring.cond);
+			pthread_mutex_unlock(&ring.lock);
+			while (i--)
+				pthread_join(tids[i], NULL);
+			pthread_join(tids[threads], NULL);
+			ring.done = false;
+			res = false;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &orig, NULL);
+	return res;
+}
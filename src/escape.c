@@ -0,0 +1,118 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <strings.h>
+
+#include "escape.h"
+
+/* Escaping of tag values for the consumers of a sink. Each mode has a
+ * table of the bytes it has to replace; values are scanned for runs of
+ * safe bytes eight at a time, or-ing their table entries so that only a
+ * run's end is branched on, and each run is copied at once. Every mode
+ * keeps a value on one line: control characters are replaced with a space
+ * (dropped with strip, escaped in JSON strings). Shell and CSV values are
+ * quoted as a whole. */
+
+static const char *names[ESCAPE_MODES] = {
+	[ESCAPE_NONE] = "none",
+	[ESCAPE_PANGO] = "pango",
+	[ESCAPE_SHELL] = "shell",
+	[ESCAPE_JSON] = "json",
+	[ESCAPE_CSV] = "csv",
+	[ESCAPE_STRIP] = "strip-control",
+};
+
+static const char *quotes[ESCAPE_MODES] = {
+	[ESCAPE_SHELL] = "'",
+	[ESCAPE_CSV] = "\"",
+};
+
+#define CONTROL \
+	[0x01] = 1, [0x02] = 1, [0x03] = 1, [0x04] = 1, [0x05] = 1, [0x06] = 1, \
+	[0x07] = 1, [0x08] = 1, [0x09] = 1, [0x0a] = 1, [0x0b] = 1, [0x0c] = 1, \
+	[0x0d] = 1, [0x0e] = 1, [0x0f] = 1, [0x10] = 1, [0x11] = 1, [0x12] = 1, \
+	[0x13] = 1, [0x14] = 1, [0x15] = 1, [0x16] = 1, [0x17] = 1, [0x18] = 1, \
+	[0x19] = 1, [0x1a] = 1, [0x1b] = 1, [0x1c] = 1, [0x1d] = 1, [0x1e] = 1, \
+	[0x1f] = 1
+
+// the bytes each mode replaces
+static const uint8_t unsafe[ESCAPE_MODES][256] = {
+	[ESCAPE_PANGO] = {CONTROL, [0x7f] = 1,
+		['&'] = 1, ['<'] = 1, ['>'] = 1, ['"'] = 1, ['\''] = 1},
+	[ESCAPE_SHELL] = {CONTROL, [0x7f] = 1, ['\''] = 1},
+	[ESCAPE_JSON] = {CONTROL, ['"'] = 1, ['\\'] = 1},
+	[ESCAPE_CSV] = {CONTROL, [0x7f] = 1, ['"'] = 1},
+	[ESCAPE_STRIP] = {CONTROL, [0x7f] = 1},
+};
+
+// the escaping mode named name, -1 if there is none
+int escape_parse(const char *name) {
+	int i;
+	for (i = 0; i < ESCAPE_MODES; ++i)
+		if (!strcasecmp(name, names[i]))
+			return i;
+	return -1;
+}
+
+// the quote around whole values, empty if the mode has none
+const char *escape_quote(enum escape e) {
+	return quotes[e] ? quotes[e] : "";
+}
+
+// whether output escaped in the mode can be cut anywhere, quotes and
+// replacements (entities, \u escapes) can not be split
+bool escape_cuttable(enum escape e) {
+	return e == ESCAPE_NONE || e == ESCAPE_STRIP;
+}
+
+// the length of the prefix of s that needs no escaping
+size_t escape_span(enum escape e, const char *str, size_t len) {
+	const unsigned char *s = (const unsigned char *) str;
+	const uint8_t *t = unsafe[e];
+	size_t i = 0;
+	if (e == ESCAPE_NONE)
+		return len;
+	while (i + 8 <= len && !(t[s[i]] | t[s[i + 1]] | t[s[i + 2]] | t[s[i + 3]] |
+			t[s[i + 4]] | t[s[i + 5]] | t[s[i + 6]] | t[s[i + 7]]))
+		i += 8;
+	while (i < len && !t[s[i]])
+		i++;
+	return i;
+}
+
+// the replacement of an unsafe byte, tmp holds at least 8 bytes
+const char *escape_byte(enum escape e, unsigned char c, char *tmp) {
+	if (e == ESCAPE_JSON) {
+		switch (c) {
+		case '"':
+			return "\\\"";
+		case '\\':
+			return "\\\\";
+		case '\n':
+			return "\\n";
+		case '\r':
+			return "\\r";
+		case '\t':
+			return "\\t";
+		case '\b':
+			return "\\b";
+		case '\f':
+			return "\\f";
+		}
+		snprintf(tmp, 8, "\\u%04x", c);
+		return tmp;
+	}
+	switch (c) {
+	case '&':
+		return "&amp;";
+	case '<':
+		return "&lt;";
+	case '>':
+		return "&gt;";
+	case '"':
+		return e == ESCAPE_CSV ? "\"\"" : "&quot;";
+	case '\'':
+		return e == ESCAPE_SHELL ? "'\\''" : "&#39;";
+	}
+	return e == ESCAPE_STRIP ? "" : " ";
+}
@@ -1,188 +1,671 @@
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <stdbool.h>
 
-#include "util.h"
+#include "clock.h"
+#include "escape.h"
 #include "formats.h"
+#include "message.h"
+#include "width.h"
 
-static int get_token(char *format, struct format_token *);
-static bool tag_counts(char *tag);
-static char *get_tag(struct mpd_song *, struct mpd_status *status, char *);
+/* Formats are compiled once into a flat program, which format_song runs
+ * for every song.
+ *
+ * Besides the '%tag|prefix|suffix|condprefix%' tokens, the grammar has:
+ *	%tag:filter:...%	filters applied to the tag value (see parse_filter)
+ *	%sticker:NAME%		the song's sticker, filters may follow the name
+ *	%( ... %)		a group, output only if every tag in it is present
+ *	%( a %| b %| c %)	alternatives, the first group with every tag
+ *				present is output
+ * Groups nest, a group which is not output does not hide its parent. */
 
-struct format_strings strings = {"playing", "stopped", "paused", "unknown"};
+#define MAX_DEPTH 16
+// set on tags referring to the next song (%next_*%)
+#define TAG_NEXT 0x8000
 
-int format_song(char **c, struct mpd_song *song, struct mpd_status *status, struct format_token *format) {
-	size_t s = 128, pos = 0, len;
-	int cnt = 0;
-	char *buf, *p;
+enum format_op {
+	OP_TEXT,
+	OP_TAG,
+	OP_GROUP,
+	OP_ALT,
+	OP_END
+};
+
+// tags that are not song tags, numbered after enum mpd_tag_type
+enum format_tag {
+	TAG_STATE = MPD_TAG_COUNT,
+	TAG_VOLUME,
+	TAG_QUEUE,
+	TAG_REPEAT,
+	TAG_RANDOM,
+	TAG_SINGLE,
+	TAG_CONSUME,
+	TAG_TIME,
+	TAG_FILE,
+	TAG_POSITION,
+	TAG_COVER,
+	TAG_STICKER,
+	TAG_DB_SONGS,
+	TAG_DB_ARTISTS,
+	TAG_DB_ALBUMS,
+	TAG_DB_PLAYTIME,
+	TAG_UPTIME,
+	TAG_UNKNOWN
+};
+
+enum format_filter {
+	FILTER_WIDTH,
+	FILTER_ZEROPAD,
+	FILTER_UPPER,
+	FILTER_LOWER,
+	FILTER_TIME,
+	FILTER_BASENAME
+};
+
+// a string in the program's pool
+struct format_str {
+	unsigned off, len;
+};
+
+struct format_insn {
+	unsigned char op, nfilters;
+	unsigned short tag;
+	union {
+		struct format_str text;
+		// OP_ALT: the end of the group, OP_END: unused
+		unsigned jump;
+		struct {
+			struct format_str prefix, suffix, condprefix;
+			// the sticker name
+			struct format_str arg;
+			unsigned filters;
+		} t;
+	};
+};
+
+struct format_program {
+	struct format_insn *code;
+	size_t len, cap;
+	char *pool;
+	size_t pool_len, pool_cap;
+	struct {
+		unsigned char type;
+		unsigned arg;
+	} *filters;
+	size_t nfilters, filters_cap;
+	// how tag values are escaped (enum escape)
+	unsigned char escape;
+	const struct format_strings *strings;
+};
+
+struct buffer {
+	char *buf;
+	size_t len, cap;
+};
+
+static const struct {
+	const char *name;
+	unsigned short tag;
+} pseudo_tags[] = {
+	{"state",	TAG_STATE},
+	{"volume",	TAG_VOLUME},
+	{"queue",	TAG_QUEUE},
+	{"repeat",	TAG_REPEAT},
+	{"random",	TAG_RANDOM},
+	{"single",	TAG_SINGLE},
+	{"consume",	TAG_CONSUME},
+	{"time",	TAG_TIME},
+	{"length",	TAG_TIME},
+	{"file",	TAG_FILE},
+	{"uri",		TAG_FILE},
+	{"position",	TAG_POSITION},
+	{"cover",	TAG_COVER},
+	{"sticker",	TAG_STICKER},
+	{"db_songs",	TAG_DB_SONGS},
+	{"db_artists",	TAG_DB_ARTISTS},
+	{"db_albums",	TAG_DB_ALBUMS},
+	{"db_playtime",	TAG_DB_PLAYTIME},
+	{"uptime",	TAG_UPTIME},
+};
+
+static const char *get_tag(struct format_data *, const struct format_strings *,
+		unsigned, char *, size_t);
+static const char *get_db_stat(const struct db_stats *, unsigned, char *, size_t);
+static const char *get_sticker(struct format_data *, struct format_program *,
+		struct format_insn *);
+static void apply_filters(struct format_program *, struct format_insn *,
+		struct buffer *);
+static struct format_insn *emit(struct format_program *, enum format_op);
+static struct format_str intern(struct format_program *, const char *, size_t);
+static unsigned short parse_tag(const char *, size_t);
+static void parse_filter(struct format_program *, const char *, size_t,
+		const struct messages *);
+static const char *parse_token(struct format_program *, const char *,
+		const struct messages *);
+
+static const struct format_strings default_strings = {
+	"playing", "stopped", "paused", "unknown"
+};
+
+static const char *const fallback_formats[] = {
+	"%artist%%title||| - %", "%name%", "%file%", NULL
+};
+
+static inline void put(struct buffer *b, const char *s, size_t len) {
+	if (b->len + len + 1 > b->cap) {
+		while (b->len + len + 1 > b->cap)
+			b->cap = b->cap ? b->cap * 2 : 128;
+		b->buf = realloc(b->buf, b->cap);
+	}
+	memcpy(b->buf + b->len, s, len);
+	b->len += len;
+	b->buf[b->len] = 0;
+}
+
+static inline void put_str(struct buffer *b, struct format_program *p,
+		struct format_str s) {
+	if (s.len)
+		put(b, p->pool + s.off, s.len);
+}
+
+// copies the safe runs of a tag value, escaping the bytes between them
+static void put_value(struct buffer *b, enum escape e, const char *s, size_t len) {
+	const char *q = escape_quote(e), *r;
+	char tmp[8];
+	size_t n;
+	put(b, q, strlen(q));
+	while (len) {
+		n = escape_span(e, s, len);
+		put(b, s, n);
+		if (n == len)
+			break;
+		r = escape_byte(e, s[n], tmp);
+		put(b, r, strlen(r));
+		s += n + 1;
+		len -= n + 1;
+	}
+	put(b, q, strlen(q));
+}
+
+int format_song(char **c, struct format_data *data, struct format_program *p) {
+	struct buffer out = {NULL, 0, 0}, val = {NULL, 0, 0};
+	struct {
+		size_t pos;
+		int cnt;
+		bool pt, fail;
+	} stack[MAX_DEPTH], *f = NULL;
+	struct format_insn *in;
+	const char *v;
+	char tmp[32];
+	size_t pc;
+	int cnt = 0, sp = 0;
 	bool pt = false;
-	if (!format)
+	if (!p)
 		return 0;
-	*c = calloc(s, 1);
-	while (format) {
-		if (format->tag) {
-			buf = get_tag(song, status, format->contents);
-			if (!buf) {
+	put(&out, "", 0);
+	for (pc = 0; pc < p->len; ++pc) {
+		in = &p->code[pc];
+		switch (in->op) {
+		case OP_TEXT:
+			put_str(&out, p, in->text);
+			break;
+		case OP_TAG:
+			if ((in->tag & ~TAG_NEXT) == TAG_STICKER)
+				v = get_sticker(data, p, in);
+			else
+				v = get_tag(data, p->strings, in->tag, tmp, sizeof(tmp));
+			if (!v || !*v) {
 				pt = false;
-				goto cont;
+				if (f)
+					f->fail = true;
+				break;
 			}
-			if (!*buf) {
-				pt = false;
-				free(buf);
-				goto cont;
+			if (pt)
+				put_str(&out, p, in->t.condprefix);
+			put_str(&out, p, in->t.prefix);
+			if (in->nfilters) {
+				val.len = 0;
+				put(&val, v, strlen(v));
+				apply_filters(p, in, &val);
+				put_value(&out, p->escape, val.buf, val.len);
+			} else {
+				put_value(&out, p->escape, v, strlen(v));
 			}
-			if (tag_counts(format->contents))
+			put_str(&out, p, in->t.suffix);
+			// only song-related tags are counted
+			if (in->tag < MPD_TAG_COUNT)
 				cnt++;
-			len = strlen(buf) +
-				(format->prefix ? strlen(format->prefix) : 0) +
-				(format->suffix ? strlen(format->suffix) : 0) +
-				(pt ? (format->condprefix ?
-				       strlen(format->condprefix)  : 0) : 0) +
-				1;
-			p = calloc(1, len);
-			if (pt && format->condprefix) strcat(p, format->condprefix);
-			if (format->prefix) strcat(p, format->prefix);
-			strcat(p, buf);
-			if (format->suffix) strcat(p, format->suffix);
-			free(buf);
-			buf = p;
 			pt = true;
-		} else {
-			buf = strdup(format->contents);
+			break;
+		case OP_GROUP:
+			f = &stack[sp++];
+			f->pos = out.len;
+			f->cnt = cnt;
+			f->pt = pt;
+			f->fail = false;
+			break;
+		case OP_ALT:
+			if (!f->fail) {
+				pc = in->jump - 1;
+				break;
+			}
+			// fall through - try the next alternative
+		case OP_END:
+			if (f->fail) {
+				out.len = f->pos;
+				out.buf[out.len] = 0;
+				cnt = f->cnt;
+				pt = f->pt;
+				f->fail = false;
+			}
+			if (in->op == OP_END)
+				f = --sp ? &stack[sp - 1] : NULL;
+			break;
 		}
-		len = pos + strlen(buf);
-		while (len + 1 > s)
-			*c = realloc(*c, s += 128);
-		pos = len;
-		strcat(*c, buf);
-		free(buf);
-cont:		format = format->next;
 	}
+	free(val.buf);
+	*c = out.buf;
 	return cnt;
 }
 
-static inline char *print_toggle(bool b) {
-	return b ? "on" : "off";
+char *render_song(struct format_list *list, struct format_data *data) {
+	int cnt;
+	char *c = NULL;
+	struct format_list *l = list->next;
+	cnt = format_song(&c, data, list->prog);
+	if (!cnt)
+		do
+			free(c);
+		while (!(cnt = format_song(&c, data, l->prog)) && (l = l->next));
+	return c;
 }
 
-static inline char *print_unsigned(unsigned u) {
-	char *c = calloc(1, 11);
-	sprintf(c, "%u", u);
-	return c;
+static inline const char *print_toggle(bool b) {
+	return b ? "on" : "off";
 }
 
-// whether to count tag, when formatting (only song-related tags are counted)
-// TODO: an option to count every tag
-static inline bool tag_counts(char *tag) {
-	return mpd_tag_name_iparse(tag) > -1;
+static inline const char *print_unsigned(char *tmp, size_t n, unsigned u) {
+	snprintf(tmp, n, "%u", u);
+	return tmp;
 }
 
-char *get_tag(struct mpd_song *song, struct mpd_status *status, char *tag) {
-	enum mpd_tag_type t = mpd_tag_name_iparse(tag);
+// returns the tag value, which is either owned by the song or put in tmp
+const char *get_tag(struct format_data *data, const struct format_strings *strings,
+		unsigned tag, char *tmp, size_t n) {
+	struct mpd_status *status = data->status;
+	struct mpd_song *song = data->song;
+	struct song_slots *slots = data->slots;
 	int i;
-	if (!status)
+	if (tag & TAG_NEXT) {
+		// art is only looked up for the current song
+		if (!data->next || tag == (TAG_NEXT | TAG_COVER))
+			return NULL;
+		song = data->next;
+		slots = NULL;
+		tag &= ~TAG_NEXT;
+	}
+	// songs from the history have no status
+	if (!status && tag >= TAG_STATE && tag <= TAG_CONSUME)
 		return NULL;
-	if (!strcasecmp(tag, "state")) {
+	switch (tag) {
+	case TAG_STATE:
 		switch (mpd_status_get_state(status)) {
 		case MPD_STATE_PLAY:
-			return strdup(strings.play);
+			return strings->play;
 		case MPD_STATE_PAUSE:
-			return strdup(strings.pause);
+			return strings->pause;
 		case MPD_STATE_STOP:
-			return strdup(strings.stop);
+			return strings->stop;
 		case MPD_STATE_UNKNOWN:
-			return strdup(strings.unknown);
+			return strings->unknown;
 		}
-	} else if (!strcasecmp(tag, "volume")) {
+		return NULL;
+	case TAG_VOLUME:
 		i = mpd_status_get_volume(status);
-		return i > 0 ? print_unsigned((unsigned) i) : "NONE";
-	} else if (!strcasecmp(tag, "queue")) {
-		return print_unsigned(mpd_status_get_queue_length(status));
-	} else if (!strcasecmp(tag, "repeat")) {
+		return i > 0 ? print_unsigned(tmp, n, (unsigned) i) : "NONE";
+	case TAG_QUEUE:
+		return print_unsigned(tmp, n, mpd_status_get_queue_length(status));
+	case TAG_REPEAT:
 		return print_toggle(mpd_status_get_repeat(status));
-	} else if (!strcasecmp(tag, "random")) {
+	case TAG_RANDOM:
 		return print_toggle(mpd_status_get_random(status));
-	} else if (!strcasecmp(tag, "single")) {
+	case TAG_SINGLE:
 		return print_toggle(mpd_status_get_single(status));
-	} else if (!strcasecmp(tag, "consume")) {
+	case TAG_CONSUME:
 		return print_toggle(mpd_status_get_consume(status));
+	case TAG_COVER:
+		return data->cover;
 	}
-	if (!song)
+	if (tag >= TAG_DB_SONGS && tag <= TAG_UPTIME)
+		return get_db_stat(data->db, tag, tmp, n);
+	if (!song && !(slots && slots->valid))
 		return NULL;
-	if (t > -1 && song) {
-		return (char *) mpd_song_get_tag(song, t, 0);
-	} else if (!strcasecmp(tag, "time") || !strcasecmp(tag, "length")) {
-		return print_unsigned(mpd_song_get_duration(song));
-	} else if (!strcasecmp(tag, "file") || !strcasecmp(tag, "uri")) {
-		return (char *) mpd_song_get_uri(song);
-	} else if (!strcasecmp(tag, "position")) {
-		return print_unsigned(mpd_song_get_pos(song) + 1);
+	if (tag < MPD_TAG_COUNT)
+		return song ? mpd_song_get_tag(song, tag, 0) : song_slots_tag(slots, tag);
+	switch (tag) {
+	case TAG_TIME:
+		return print_unsigned(tmp, n,
+			song ? mpd_song_get_duration(song) : slots->duration);
+	case TAG_FILE:
+		return song ? mpd_song_get_uri(song) : song_slots_uri(slots);
+	case TAG_POSITION:
+		return print_unsigned(tmp, n,
+			(song ? mpd_song_get_pos(song) : slots->pos) + 1);
 	}
 	return NULL;
 }
 
-struct format_token *parse_format(char *format) {
-	struct format_token *ret = NULL, **tok;
-	int i = 0;
-	if (!format)
+// the uptime is extrapolated from the last refresh, not queried again
+const char *get_db_stat(const struct db_stats *db, unsigned tag, char *tmp, size_t n) {
+	if (!db || !db->valid)
 		return NULL;
-	// the following prevents an empty token from appearing at the end
-	for (tok = &ret;
-		(i = get_token(format += i,
-			*tok = malloc(sizeof(struct format_token))));
-		tok = &(*tok)->next)
-		if (!ret)
-			ret = *tok;
-	free(*tok);
-	*tok = NULL;
-	return ret;
-}
-
-int get_token(char *format, struct format_token *tok) {
-	int cnt = 0, i = 0;
-	char *c = format, **p;
-	if (!format)
-		return cnt;
-	tok->tag = *format == '%';
-	tok->contents = tok->prefix = tok->suffix = tok->condprefix = NULL;
-	tok->next = NULL;
-	if (tok->tag) {
-		c++, cnt++, format++;
-		if (*format == '%' || !*format) {
-			tok->tag = false, tok->contents = "%";
-			return cnt;
-		}
+	switch (tag) {
+	case TAG_DB_SONGS:
+		return print_unsigned(tmp, n, db->songs);
+	case TAG_DB_ARTISTS:
+		return print_unsigned(tmp, n, db->artists);
+	case TAG_DB_ALBUMS:
+		return print_unsigned(tmp, n, db->albums);
+	case TAG_DB_PLAYTIME:
+		snprintf(tmp, n, "%lu", db->playtime);
+		return tmp;
+	case TAG_UPTIME:
+		snprintf(tmp, n, "%lu", db->uptime +
+			(unsigned long) ((clock_us() - db->fetched) / 1000000));
+		return tmp;
 	}
-	while (*format) {
-		cnt++;
-		switch (*format) {
-		case '%':
-			if (!tok->tag)
-				cnt--;
-			goto br;
-		case '|':
-			if (!tok->tag || i == 3)
+	return NULL;
+}
+
+// stickers are only looked up for the current song
+const char *get_sticker(struct format_data *data, struct format_program *p,
+		struct format_insn *in) {
+	if (in->tag & TAG_NEXT || !data->stickers || !in->t.arg.len)
+		return NULL;
+	return stickers_value(data->stickers, p->pool + in->t.arg.off, in->t.arg.len);
+}
+
+const char *format_data_tag(struct format_data *data, enum mpd_tag_type tag) {
+	if (data->song)
+		return mpd_song_get_tag(data->song, tag, 0);
+	return data->slots && data->slots->valid ? song_slots_tag(data->slots, tag) : NULL;
+}
+
+const char *format_data_uri(struct format_data *data) {
+	if (data->song)
+		return mpd_song_get_uri(data->song);
+	return data->slots && data->slots->valid ? song_slots_uri(data->slots) : NULL;
+}
+
+void apply_filters(struct format_program *p, struct format_insn *in,
+		struct buffer *v) {
+	unsigned i, arg, u;
+	size_t j, n;
+	int ellipsis;
+	char tmp[32], *c;
+	for (i = in->t.filters; i < in->t.filters + in->nfilters; ++i) {
+		arg = p->filters[i].arg;
+		switch (p->filters[i].type) {
+		case FILTER_WIDTH:
+			// limit the value to arg display columns
+			v->len = width_truncate(v->buf, v->len, arg, &ellipsis);
+			v->buf[v->len] = 0;
+			if (ellipsis)
+				put(v, ELLIPSIS, strlen(ELLIPSIS));
+			break;
+		case FILTER_ZEROPAD:
+			if ((n = v->len) >= arg)
 				break;
-			p = i == 0 ? &tok->contents :
-				i == 1 ? &tok->prefix :
-				i == 2 ? &tok->suffix :
-				&tok->condprefix;
-			*p = calloc(1, format - c + 1);
-			strncpy(*p, c, format - c);
-			c = format + 1;
-			i++;
+			for (j = n; j < arg; ++j)
+				put(v, "0", 1);
+			memmove(v->buf + arg - n, v->buf, n);
+			memset(v->buf, '0', arg - n);
+			break;
+		case FILTER_UPPER:
+			for (j = 0; j < v->len; ++j)
+				v->buf[j] = toupper((unsigned char) v->buf[j]);
+			break;
+		case FILTER_LOWER:
+			for (j = 0; j < v->len; ++j)
+				v->buf[j] = tolower((unsigned char) v->buf[j]);
+			break;
+		case FILTER_TIME:
+			u = strtoul(v->buf, NULL, 10);
+			if (u >= 3600)
+				snprintf(tmp, sizeof(tmp), "%u:%02u:%02u",
+					u / 3600, u / 60 % 60, u % 60);
+			else
+				snprintf(tmp, sizeof(tmp), "%u:%02u", u / 60, u % 60);
+			v->len = 0;
+			put(v, tmp, strlen(tmp));
+			break;
+		case FILTER_BASENAME:
+			if ((c = strrchr(v->buf, '/'))) {
+				v->len -= c + 1 - v->buf;
+				memmove(v->buf, c + 1, v->len + 1);
+			}
+			if ((c = strrchr(v->buf, '.')) && c != v->buf) {
+				*c = 0;
+				v->len = c - v->buf;
+			}
 			break;
 		}
-		format++;
-	}
-br:	p = !tok->tag ? &tok->contents :
-		i == 0 ? &tok->contents :
-		i == 1 ? &tok->prefix :
-		i == 2 ? &tok->suffix :
-		&tok->condprefix;
-	*p = calloc(format - c + 1, 1);
-	strncpy(*p, c, format - c);
-	return cnt;
+	}
+}
+
+// marks the song tags referenced by the formats (not by %next_*% tags)
+void format_tags(struct format_list *l, bool *wanted) {
+	size_t i;
+	for (; l; l = l->next)
+		for (i = 0; l->prog && i < l->prog->len; ++i)
+			if (l->prog->code[i].op == OP_TAG &&
+					l->prog->code[i].tag < MPD_TAG_COUNT)
+				wanted[l->prog->code[i].tag] = true;
+}
+
+bool format_db_stats(struct format_list *l) {
+	size_t i;
+	for (; l; l = l->next)
+		for (i = 0; l->prog && i < l->prog->len; ++i)
+			if (l->prog->code[i].op == OP_TAG &&
+					(l->prog->code[i].tag & ~TAG_NEXT) >= TAG_DB_SONGS &&
+					(l->prog->code[i].tag & ~TAG_NEXT) <= TAG_UPTIME)
+				return true;
+	return false;
+}
+
+bool format_stickers(struct format_list *l) {
+	size_t i;
+	for (; l; l = l->next)
+		for (i = 0; l->prog && i < l->prog->len; ++i)
+			if (l->prog->code[i].op == OP_TAG &&
+					(l->prog->code[i].tag & ~TAG_NEXT) == TAG_STICKER)
+				return true;
+	return false;
+}
+
+struct format_insn *emit(struct format_program *p, enum format_op op) {
+	if (p->len == p->cap)
+		p->code = realloc(p->code,
+			(p->cap = p->cap ? p->cap * 2 : 16) * sizeof(*p->code));
+	memset(&p->code[p->len], 0, sizeof(*p->code));
+	p->code[p->len].op = op;
+	return &p->code[p->len++];
+}
+
+struct format_str intern(struct format_program *p, const char *s, size_t len) {
+	struct format_str r = {p->pool_len, len};
+	// the pool may not be allocated yet
+	if (!len)
+		return r;
+	if (p->pool_len + len > p->pool_cap) {
+		while (p->pool_len + len > p->pool_cap)
+			p->pool_cap = p->pool_cap ? p->pool_cap * 2 : 64;
+		p->pool = realloc(p->pool, p->pool_cap);
+	}
+	memcpy(p->pool + p->pool_len, s, len);
+	p->pool_len += len;
+	return r;
+}
+
+unsigned short parse_tag(const char *name, size_t len) {
+	char buf[64];
+	size_t i;
+	int t;
+	if (len >= sizeof(buf))
+		return TAG_UNKNOWN;
+	if (len > 5 && !strncasecmp(name, "next_", 5))
+		return TAG_NEXT | parse_tag(name + 5, len - 5);
+	memcpy(buf, name, len);
+	buf[len] = 0;
+	for (i = 0; i < sizeof(pseudo_tags) / sizeof(pseudo_tags[0]); ++i)
+		if (!strcasecmp(buf, pseudo_tags[i].name))
+			return pseudo_tags[i].tag;
+	t = mpd_tag_name_iparse(buf);
+	return t > -1 ? t : TAG_UNKNOWN;
+}
+
+void parse_filter(struct format_program *p, const char *f, size_t len,
+		const struct messages *m) {
+	static const char *names[] = {
+		[FILTER_UPPER] = "upper",
+		[FILTER_LOWER] = "lower",
+		[FILTER_TIME] = "time",
+		[FILTER_BASENAME] = "basename",
+	};
+	struct format_insn *in = &p->code[p->len - 1];
+	unsigned i;
+	int type = -1, arg = 0;
+	if (len && isdigit((unsigned char) *f)) {
+		type = len > 1 && *f == '0' ? FILTER_ZEROPAD : FILTER_WIDTH;
+		arg = atoi(f);
+	}
+	for (i = 0; type < 0 && i < sizeof(names) / sizeof(names[0]); ++i)
+		if (names[i] && strlen(names[i]) == len && !strncasecmp(f, names[i], len))
+			type = i;
+	if (type < 0) {
+		message(m, "Unknown format filter '%.*s'", (int) len, f);
+		return;
+	}
+	if (p->nfilters == p->filters_cap)
+		p->filters = realloc(p->filters, (p->filters_cap =
+			p->filters_cap ? p->filters_cap * 2 : 4) * sizeof(*p->filters));
+	if (!in->nfilters)
+		in->t.filters = p->nfilters;
+	p->filters[p->nfilters].type = type;
+	p->filters[p->nfilters++].arg = arg;
+	in->nfilters++;
+}
+
+// parses a tag token following its '%', returns the position after it
+const char *parse_token(struct format_program *p, const char *c,
+		const struct messages *m) {
+	struct format_insn *in = emit(p, OP_TAG);
+	struct format_str *fields[] = {&in->t.prefix, &in->t.suffix, &in->t.condprefix};
+	const char *e, *name, *f, *s;
+	unsigned i;
+	for (e = c; *e && *e != '%'; ++e);
+	for (name = c; name < e && *name != '|'; ++name);
+	for (f = c; f < name && *f != ':'; ++f);
+	in->tag = parse_tag(c, f - c);
+	if ((in->tag & ~TAG_NEXT) == TAG_STICKER && f < name) {
+		for (s = ++f; f < name && *f != ':'; ++f);
+		in->t.arg = intern(p, s, f - s);
+	}
+	while (f < name) {
+		for (s = ++f; f < name && *f != ':'; ++f);
+		parse_filter(p, s, f - s, m);
+	}
+	// the condprefix takes the rest of the token, '|' included
+	for (i = 0, s = name; i < 3 && s < e; ++i, s = f) {
+		for (f = ++s; f < e && (*f != '|' || i == 2); ++f);
+		*fields[i] = intern(p, s, f - s);
+	}
+	return *e ? e + 1 : e;
+}
+
+// patches the group's alternatives to jump to its end
+static void close_group(struct format_program *p, unsigned alt) {
+	unsigned prev;
+	emit(p, OP_END);
+	for (; alt != ~0u; alt = prev) {
+		prev = p->code[alt].jump;
+		p->code[alt].jump = p->len - 1;
+	}
+}
+
+// without options, values are not escaped and problems go to stderr
+struct format_program *parse_format(const char *format,
+		const struct format_options *o) {
+	struct format_program *p;
+	// per open group, the last alternative, linked to the previous ones
+	unsigned alts[MAX_DEPTH];
+	int depth = 0;
+	const char *c = format, *s;
+	if (!format)
+		return NULL;
+	p = calloc(1, sizeof(*p));
+	p->escape = o ? o->escape : ESCAPE_NONE;
+	p->strings = o && o->strings ? o->strings : &default_strings;
+	while (*c) {
+		if (*c != '%') {
+			for (s = c; *c && *c != '%'; ++c);
+			emit(p, OP_TEXT)->text = intern(p, s, c - s);
+		} else if (!c[1] || c[1] == '%') {
+			emit(p, OP_TEXT)->text = intern(p, "%", 1);
+			c++;
+		} else if (c[1] == '(' && depth < MAX_DEPTH) {
+			emit(p, OP_GROUP);
+			alts[depth++] = ~0u;
+			c += 2;
+		} else if (c[1] == '|' && depth) {
+			emit(p, OP_ALT)->jump = alts[depth - 1];
+			alts[depth - 1] = p->len - 1;
+			c += 2;
+		} else if (c[1] == ')' && depth) {
+			close_group(p, alts[--depth]);
+			c += 2;
+		} else {
+			c = parse_token(p, c + 1, o ? o->log : NULL);
+		}
+	}
+	while (depth)
+		close_group(p, alts[--depth]);
+	return p;
+}
+
+// compiles the format followed by the fallback formats
+void compile_formats(struct format_list *l, const char *format,
+		const struct format_options *o) {
+	const char *const *p = fallback_formats;
+	l->prog = parse_format(format, o);
+	while (*p) {
+		l->next = calloc(1, sizeof(struct format_list));
+		l = l->next;
+		l->prog = parse_format(*p, o);
+		p++;
+	}
+}
+
+// frees the list's programs and the fallback entries after its head
+void free_formats(struct format_list *l) {
+	struct format_list *next;
+	free_format(l->prog);
+	for (l = l->next; l; l = next) {
+		next = l->next;
+		free_format(l->prog);
+		free(l);
+	}
+}
+
+void free_format(struct format_program *p) {
+	if (!p)
+		return;
+	free(p->code);
+	free(p->pool);
+	free(p->filters);
+	free(p);
 }
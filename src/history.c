@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "util.h"
+
+/* The play history is an append-only file of entries, each a fixed header
+ * followed by the tag values seen for the first time in it. Later entries
+ * refer to those values by their file offset, so every distinct string is
+ * stored once. PATH.idx is a sparse index with the time and offset of every
+ * INDEX_STRIDE-th entry; queries binary search it and scan the (mapped)
+ * entries from there. Times never decrease, a clock going backwards is
+ * recorded as the previous time. The index is rebuilt on every open, which
+ * also drops an entry left incomplete by a crash. Only the INTERN_MAX most
+ * recently used values are kept in memory, a value evicted from them is
+ * stored again the next time it is played. */
+
+#define MAGIC "MPDSUBH1"
+#define INDEX_STRIDE 64
+#define INTERN_BUCKETS 4096
+#define INTERN_MAX 65536
+// values are referred to by 32-bit offsets
+#define MAX_SIZE UINT32_MAX
+
+struct entry {
+	int64_t time;
+	uint32_t id, duration;
+	// file offsets of the values, 0 if unset
+	uint32_t tags[HISTORY_TAGS];
+	// size of the values following the header, padded to 8 bytes
+	uint32_t len, reserved;
+};
+
+struct index {
+	int64_t time;
+	uint64_t off;
+};
+
+struct interned {
+	// the bucket chain, and the recently used list
+	struct interned *next, *newer, *older;
+	uint32_t off;
+	char s[];
+};
+
+static struct {
+	int fd, idx;
+	uint64_t size, count;
+	int64_t last;
+	struct interned *strings[INTERN_BUCKETS];
+	struct interned *newest, *oldest;
+	unsigned interned;
+} h = {.fd = -1, .idx = -1};
+
+static uint32_t hash(const char *);
+static uint32_t lookup(const char *);
+static void intern(const char *, uint32_t off);
+static void touch(struct interned *);
+static void unlink_interned(struct interned *);
+static bool valid(const char *map, uint64_t size, uint64_t off);
+static bool scan(const char *map, uint64_t size);
+
+bool history_open(const char *path) {
+	size_t len = strlen(path) + 5;
+	char *idx = malloc(len);
+	struct stat st;
+	char *map;
+	bool ok;
+	snprintf(idx, len, "%s.idx", path);
+	h.fd = open(path, O_RDWR | O_CREAT, 0644);
+	h.idx = open(idx, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	free(idx);
+	if (h.fd < 0 || h.idx < 0 || fstat(h.fd, &st)) {
+		log("%s: ", path);
+		perror("Could not open the history");
+		return false;
+	}
+	if (!st.st_size) {
+		if (write(h.fd, MAGIC, 8) != 8) {
+			perror("Could not write the history");
+			return false;
+		}
+		h.size = 8;
+		return true;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, h.fd, 0);
+	if (map == MAP_FAILED || st.st_size < 8 || memcmp(map, MAGIC, 8)) {
+		log("%s: not a history file\n", path);
+		if (map != MAP_FAILED)
+			munmap(map, st.st_size);
+		return false;
+	}
+	ok = scan(map, st.st_size);
+	munmap(map, st.st_size);
+	if (h.size < (uint64_t) st.st_size && ftruncate(h.fd, h.size))
+		perror("Could not truncate the history");
+	return ok;
+}
+
+bool history_append(const struct history_item *it) {
+	struct entry e = {.time = it->time, .id = it->id, .duration = it->duration};
+	struct index ix;
+	char *buf;
+	size_t len = 0, n, i, j;
+	bool ok;
+	if (h.fd < 0)
+		return false;
+	if (e.time < h.last)
+		e.time = h.last;
+	for (i = 0; i < HISTORY_TAGS; ++i)
+		if (it->tags[i] && *it->tags[i] && !lookup(it->tags[i]))
+			len += strlen(it->tags[i]) + 1;
+	e.len = (len + 7) & ~7;
+	if (h.size + sizeof(e) + e.len > MAX_SIZE) {
+		log("The history is full (4 GiB), not recording.\n");
+		return false;
+	}
+	buf = calloc(1, sizeof(e) + e.len);
+	for (i = 0, len = sizeof(e); i < HISTORY_TAGS; ++i) {
+		if (!it->tags[i] || !*it->tags[i] || (e.tags[i] = lookup(it->tags[i])))
+			continue;
+		// a value repeated within the entry is stored once
+		for (j = 0; j < i && (e.tags[j] < h.size || !it->tags[j] ||
+				strcmp(it->tags[j], it->tags[i])); ++j);
+		if (j < i) {
+			e.tags[i] = e.tags[j];
+			continue;
+		}
+		n = strlen(it->tags[i]) + 1;
+		memcpy(buf + len, it->tags[i], n);
+		e.tags[i] = h.size + len;
+		len += n;
+	}
+	memcpy(buf, &e, sizeof(e));
+	if ((ok = pwrite(h.fd, buf, sizeof(e) + e.len, h.size) ==
+			(ssize_t) (sizeof(e) + e.len))) {
+		// the new values are only referred to once they are written
+		for (i = 0; i < HISTORY_TAGS; ++i)
+			if (e.tags[i] >= h.size && !lookup(it->tags[i]))
+				intern(it->tags[i], e.tags[i]);
+		if (h.count++ % INDEX_STRIDE == 0) {
+			ix.time = e.time;
+			ix.off = h.size;
+			if (write(h.idx, &ix, sizeof(ix)) != sizeof(ix))
+				perror("Could not write the history index");
+		}
+		h.size += sizeof(e) + e.len;
+		h.last = e.time;
+	} else {
+		perror("Could not write the history");
+	}
+	free(buf);
+	return ok;
+}
+
+// calls cb for every entry played between from and to (inclusive)
+int history_query(const char *path, int64_t from, int64_t to,
+		void (*cb)(void *, const struct history_item *), void *ctx) {
+	size_t len = strlen(path) + 5;
+	char *idx = malloc(len), *map;
+	const struct index *ix = MAP_FAILED;
+	const struct entry *e;
+	struct history_item it;
+	struct stat st, ist;
+	uint64_t off = 8;
+	size_t lo, hi, mid, n = 0, i;
+	int fd, ifd, cnt = 0;
+	snprintf(idx, len, "%s.idx", path);
+	fd = open(path, O_RDONLY);
+	ifd = open(idx, O_RDONLY);
+	free(idx);
+	if (fd < 0 || fstat(fd, &st)) {
+		log("%s: ", path);
+		perror("Could not open the history");
+		return -1;
+	}
+	map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (map == MAP_FAILED || st.st_size < 8 || memcmp(map, MAGIC, 8)) {
+		log("%s: not a history file\n", path);
+		close(fd);
+		return -1;
+	}
+	// the last indexed entry before from, a missing index means a full scan
+	if (ifd >= 0 && !fstat(ifd, &ist) && (n = ist.st_size / sizeof(*ix)))
+		ix = mmap(NULL, n * sizeof(*ix), PROT_READ, MAP_SHARED, ifd, 0);
+	if (ix != MAP_FAILED) {
+		for (lo = 0, hi = n; lo < hi;) {
+			mid = lo + (hi - lo) / 2;
+			if (ix[mid].time < from)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo && ix[lo - 1].off < (uint64_t) st.st_size)
+			off = ix[lo - 1].off;
+		munmap((void *) ix, n * sizeof(*ix));
+	}
+	for (; valid(map, st.st_size, off); off += sizeof(*e) + e->len) {
+		e = (const struct entry *) (map + off);
+		if (e->time > to)
+			break;
+		if (e->time < from)
+			continue;
+		it.time = e->time;
+		it.id = e->id;
+		it.duration = e->duration;
+		for (i = 0; i < HISTORY_TAGS; ++i)
+			it.tags[i] = e->tags[i] && e->tags[i] < st.st_size ?
+				map + e->tags[i] : NULL;
+		cb(ctx, &it);
+		cnt++;
+	}
+	munmap(map, st.st_size);
+	close(fd);
+	if (ifd >= 0)
+		close(ifd);
+	return cnt;
+}
+
+// seconds since the epoch, or a local YYYY-MM-DD[ HH:MM[:SS]]
+bool history_parse_time(const char *s, int64_t *t) {
+	static const char *formats[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S",
+		"%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d"
+	};
+	struct tm tm;
+	char *end;
+	size_t i;
+	*t = strtoll(s, &end, 10);
+	if (*s && !*end)
+		return true;
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+		memset(&tm, 0, sizeof(tm));
+		if ((end = strptime(s, formats[i], &tm)) && !*end) {
+			tm.tm_isdst = -1;
+			*t = mktime(&tm);
+			return true;
+		}
+	}
+	return false;
+}
+
+// FNV-1a
+uint32_t hash(const char *s) {
+	uint32_t r = 0x811c9dc5;
+	for (; *s; ++s)
+		r = (r ^ (unsigned char) *s) * 0x01000193;
+	return r;
+}
+
+uint32_t lookup(const char *s) {
+	struct interned *i = h.strings[hash(s) % INTERN_BUCKETS];
+	for (; i; i = i->next)
+		if (!strcmp(i->s, s)) {
+			touch(i);
+			return i->off;
+		}
+	return 0;
+}
+
+// a value stored again refers to its latest copy
+void intern(const char *s, uint32_t off) {
+	size_t len = strlen(s) + 1;
+	struct interned *i, **b = &h.strings[hash(s) % INTERN_BUCKETS];
+	for (i = *b; i; i = i->next)
+		if (!strcmp(i->s, s)) {
+			i->off = off;
+			touch(i);
+			return;
+		}
+	if (h.interned == INTERN_MAX) {
+		i = h.oldest;
+		unlink_interned(i);
+		free(i);
+		h.interned--;
+	}
+	i = malloc(sizeof(*i) + len);
+	memcpy(i->s, s, len);
+	i->off = off;
+	i->next = *b;
+	*b = i;
+	i->older = h.newest;
+	i->newer = NULL;
+	if (h.newest)
+		h.newest->newer = i;
+	else
+		h.oldest = i;
+	h.newest = i;
+	h.interned++;
+}
+
+// moves the value to the front of the recently used list
+void touch(struct interned *i) {
+	if (i == h.newest)
+		return;
+	i->newer->older = i->older;
+	if (i->older)
+		i->older->newer = i->newer;
+	else
+		h.oldest = i->newer;
+	i->older = h.newest;
+	i->newer = NULL;
+	h.newest->newer = i;
+	h.newest = i;
+}
+
+// removes the value from its bucket and the recently used list
+void unlink_interned(struct interned *i) {
+	struct interned **p = &h.strings[hash(i->s) % INTERN_BUCKETS];
+	while (*p != i)
+		p = &(*p)->next;
+	*p = i->next;
+	if (i->newer)
+		i->newer->older = i->older;
+	else
+		h.newest = i->older;
+	if (i->older)
+		i->older->newer = i->newer;
+	else
+		h.oldest = i->newer;
+}
+
+// whether a complete entry starts at off
+bool valid(const char *map, uint64_t size, uint64_t off) {
+	const struct entry *e = (const struct entry *) (map + off);
+	return off + sizeof(*e) <= size && off + sizeof(*e) + e->len <= size;
+}
+
+// interns the stored values and rebuilds the index, up to the last valid entry
+bool scan(const char *map, uint64_t size) {
+	const struct entry *e;
+	const char *c, *end;
+	struct index ix;
+	uint64_t off;
+	for (off = 8; valid(map, size, off); off += sizeof(*e) + e->len) {
+		e = (const struct entry *) (map + off);
+		c = map + off + sizeof(*e);
+		for (end = c + e->len; c < end && *c; c += strnlen(c, end - c) + 1)
+			intern(c, c - map);
+		if (h.count++ % INDEX_STRIDE == 0) {
+			ix.time = e->time;
+			ix.off = off;
+			if (write(h.idx, &ix, sizeof(ix)) != sizeof(ix)) {
+				perror("Could not write the history index");
+				return false;
+			}
+		}
+		h.last = e->time;
+	}
+	h.size = off;
+	return true;
+}
@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <mpd/client.h>
+
+#include "escape.h"
+#include "i3bar.h"
+#include "util.h"
+
+/* The i3bar (and swaybar) protocol: a header, then an endless JSON array
+ * with the status line, a single block here, as its elements. A block is
+ * only written when its text changes. Click events come as an endless
+ * array on stdin, one event per line, and are read without blocking
+ * between idle events; the clicked button is mapped to an mpd command,
+ * run over the main connection. */
+
+#define MAX_BUTTONS 10
+// arguments after the command
+#define MAX_ARGS 4
+
+static void put_len(const char *s, size_t len);
+static void put(const char *s);
+static void put_json(const char *s);
+static bool run(struct mpd_connection *, char *command);
+static void click(struct mpd_connection *, const char *event, bool *ok);
+
+static struct {
+	bool markup, started;
+	// the last block's text
+	char *last;
+	// the block being written
+	char *buf;
+	size_t len, cap;
+	// the unterminated line of click events read so far
+	char in[4096];
+	size_t in_len;
+	char *buttons[MAX_BUTTONS];
+} bar = {
+	.buttons = {
+		[1] = "pause",
+		[3] = "next",
+		[4] = "previous",
+		[5] = "next",
+	},
+};
+
+// writes the header and reads click events from stdin without blocking
+void i3bar_init(struct sink *s, bool markup) {
+	bar.markup = markup;
+	sink_write(s, "{\"version\":1,\"click_events\":true}\n[");
+	fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+}
+
+// maps a mouse button to an mpd command line, empty to ignore it
+bool i3bar_bind(unsigned button, const char *command) {
+	const char *c = command;
+	int words = 0;
+	if (button >= MAX_BUTTONS)
+		return false;
+	for (c += strspn(c, " \t"); *c; c += strspn(c, " \t"), words++)
+		c += strcspn(c, " \t");
+	if (words > MAX_ARGS + 1) {
+		log("i3bar button%u: at most %d arguments are passed, unbound\n",
+			button, MAX_ARGS);
+		bar.buttons[button] = NULL;
+		return true;
+	}
+	bar.buttons[button] = *command ? strdup(command) : NULL;
+	return true;
+}
+
+void i3bar_write(struct sink *s, const char *line) {
+	if (bar.last && !strcmp(line, bar.last))
+		return;
+	free(bar.last);
+	bar.last = strdup(line);
+	bar.len = 0;
+	if (bar.started)
+		put(",");
+	bar.started = true;
+	put("[{\"name\":\"mpdsub\",\"full_text\":\"");
+	put_json(line);
+	put("\"");
+	if (bar.markup)
+		put(",\"markup\":\"pango\"");
+	put("}]");
+	sink_write(s, bar.buf);
+}
+
+/* Runs the commands bound to the clicks read from stdin. Returns -1 on
+ * connection errors, 0 once stdin is closed. */
+int i3bar_click(struct mpd_connection *conn) {
+	char *c, *e;
+	ssize_t n;
+	bool ok = true;
+	while ((n = read(STDIN_FILENO, bar.in + bar.in_len,
+			sizeof(bar.in) - bar.in_len - 1)) > 0) {
+		bar.in_len += n;
+		bar.in[bar.in_len] = 0;
+		for (c = bar.in; (e = strchr(c, '\n')); c = e + 1) {
+			*e = 0;
+			click(conn, c, &ok);
+		}
+		bar.in_len -= c - bar.in;
+		memmove(bar.in, c, bar.in_len);
+		// an overlong line is dropped
+		if (bar.in_len == sizeof(bar.in) - 1)
+			bar.in_len = 0;
+	}
+	if (!ok)
+		return -1;
+	return !n || (errno != EAGAIN && errno != EWOULDBLOCK) ? 0 : 1;
+}
+
+// runs the command bound to the event's button, if any
+void click(struct mpd_connection *conn, const char *event, bool *ok) {
+	const char *b = strstr(event, "\"button\"");
+	char *command;
+	unsigned button;
+	if (!b || !(b = strchr(b, ':')))
+		return;
+	button = strtoul(b + 1, NULL, 10);
+	if (!*ok || button >= MAX_BUTTONS || !bar.buttons[button])
+		return;
+	command = strdup(bar.buttons[button]);
+	*ok = run(conn, command);
+	free(command);
+}
+
+// sends a command line, split at spaces, returns false on connection errors
+bool run(struct mpd_connection *conn, char *command) {
+	char *args[MAX_ARGS + 1] = {NULL}, *save;
+	int i = 0;
+	for (args[0] = strtok_r(command, " \t", &save); args[i] && i < MAX_ARGS;)
+		args[++i] = strtok_r(NULL, " \t", &save);
+	if (!args[0])
+		return true;
+	if (mpd_send_command(conn, args[0], args[1], args[2], args[3], args[4], NULL) &&
+			mpd_response_finish(conn))
+		return true;
+	log("Click command '%s' failed: %s\n", args[0],
+		mpd_connection_get_error_message(conn));
+	return mpd_connection_clear_error(conn);
+}
+
+void put(const char *s) {
+	put_len(s, strlen(s));
+}
+
+void put_len(const char *s, size_t len) {
+	if (bar.len + len + 1 > bar.cap) {
+		while (bar.len + len + 1 > bar.cap)
+			bar.cap = bar.cap ? bar.cap * 2 : 128;
+		bar.buf = realloc(bar.buf, bar.cap);
+	}
+	memcpy(bar.buf + bar.len, s, len);
+	bar.len += len;
+	bar.buf[bar.len] = 0;
+}
+
+// the line as the contents of a JSON string
+void put_json(const char *s) {
+	size_t len = strlen(s), n;
+	const char *r;
+	char tmp[8];
+	while (len) {
+		n = escape_span(ESCAPE_JSON, s, len);
+		put_len(s, n);
+		if (n == len)
+			break;
+		r = escape_byte(ESCAPE_JSON, s[n], tmp);
+		put(r);
+		s += n + 1;
+		len -= n + 1;
+	}
+}
@@ -0,0 +1,321 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "listen.h"
+#include "stats.h"
+#include "util.h"
+
+/* Listening statistics: plays and listened time per artist, album and
+ * track. Only the time spent in the play state between two events is
+ * credited. Tag values are interned and shared by the aggregates that use
+ * them. Each kind keeps at most max aggregates; when full, the quarter
+ * with the least listened time is folded into a per-kind "other" total.
+ * The snapshot file is rewritten every interval seconds (checked on
+ * events) and on exit, and is loaded again on startup. */
+
+#define STR_BUCKETS 4096
+#define AGG_BUCKETS 4096
+
+enum kind {
+	KIND_ARTIST,
+	KIND_ALBUM,
+	KIND_TRACK,
+	KINDS
+};
+
+static const char *kind_names[] = {
+	[KIND_ARTIST] = "artist",
+	[KIND_ALBUM] = "album",
+	[KIND_TRACK] = "track",
+};
+
+struct str {
+	struct str *next;
+	uint32_t hash;
+	unsigned refs;
+	char s[];
+};
+
+struct agg {
+	struct agg *next;
+	struct str *a, *b;
+	uint64_t plays, ms;
+	// pinned while its song is the current one
+	bool pinned, doomed;
+};
+
+static struct {
+	char *path;
+	uint64_t interval, last;
+	unsigned max;
+	struct str *strings[STR_BUCKETS];
+	struct table {
+		struct agg *buckets[AGG_BUCKETS];
+		unsigned count;
+		uint64_t other_plays, other_ms;
+	} tables[KINDS];
+	// the song being listened to
+	struct {
+		int id;
+		bool playing, counted;
+		uint64_t since;
+		struct agg *aggs[KINDS];
+	} cur;
+} l = {.cur = {.id = -1}};
+
+static void credit(uint64_t now);
+static uint32_t hash(const char *);
+static struct str *intern(const char *);
+static void release(struct str *);
+static struct agg *aggregate(enum kind, const char *a, const char *b);
+static void evict(struct table *);
+static void load(void);
+static void put_value(FILE *, const struct str *);
+
+bool listen_init(const char *path, int interval, unsigned max) {
+	l.path = strdup(path);
+	l.interval = (uint64_t) interval * 1000000;
+	l.max = max;
+	load();
+	l.last = stats_clock();
+	return true;
+}
+
+// credits the time since the previous update to the song then playing
+void listen_update(bool playing, const struct listen_song *song) {
+	uint64_t now = stats_clock();
+	const char *artist = song && song->album_artist ? song->album_artist :
+		song ? song->artist : NULL;
+	unsigned k;
+	credit(now);
+	if (!song || song->id != l.cur.id) {
+		for (k = 0; k < KINDS; ++k)
+			if (l.cur.aggs[k])
+				l.cur.aggs[k]->pinned = false;
+		memset(l.cur.aggs, 0, sizeof(l.cur.aggs));
+		l.cur.id = song ? song->id : -1;
+		l.cur.counted = false;
+		if (song) {
+			l.cur.aggs[KIND_ARTIST] = aggregate(KIND_ARTIST, song->artist, NULL);
+			l.cur.aggs[KIND_ALBUM] = aggregate(KIND_ALBUM, artist, song->album);
+			l.cur.aggs[KIND_TRACK] = aggregate(KIND_TRACK, song->artist, song->title);
+		}
+	}
+	// a play is counted once the song actually plays
+	if (playing && !l.cur.counted) {
+		for (k = 0; k < KINDS; ++k)
+			if (l.cur.aggs[k])
+				l.cur.aggs[k]->plays++;
+		l.cur.counted = true;
+	}
+	l.cur.playing = playing && song;
+	if (l.interval && now - l.last >= l.interval)
+		listen_snapshot();
+}
+
+int listen_snapshot() {
+	size_t len = strlen(l.path) + 5, i;
+	struct agg *a;
+	unsigned k;
+	char *tmp;
+	FILE *f;
+	credit(l.last = stats_clock());
+	tmp = malloc(len);
+	snprintf(tmp, len, "%s.tmp", l.path);
+	if (!(f = fopen(tmp, "w"))) {
+		perror("Could not open listening statistics for writing");
+		free(tmp);
+		return -1;
+	}
+	fprintf(f, "# kind\tplays\tseconds\tartist\t[album|title]\n");
+	for (k = 0; k < KINDS; ++k) {
+		for (i = 0; i < AGG_BUCKETS; ++i) {
+			for (a = l.tables[k].buckets[i]; a; a = a->next) {
+				fprintf(f, "%s\t%" PRIu64 "\t%" PRIu64 ".%03u\t", kind_names[k],
+					a->plays, a->ms / 1000, (unsigned) (a->ms % 1000));
+				put_value(f, a->a);
+				if (k != KIND_ARTIST) {
+					fputc('\t', f);
+					put_value(f, a->b);
+				}
+				fputc('\n', f);
+			}
+		}
+		if (l.tables[k].other_plays || l.tables[k].other_ms)
+			fprintf(f, "other\t%" PRIu64 "\t%" PRIu64 ".%03u\t%s\n",
+				l.tables[k].other_plays, l.tables[k].other_ms / 1000,
+				(unsigned) (l.tables[k].other_ms % 1000), kind_names[k]);
+	}
+	if (fclose(f) || rename(tmp, l.path)) {
+		perror("Could not write listening statistics");
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+void credit(uint64_t now) {
+	unsigned k;
+	if (l.cur.playing)
+		for (k = 0; k < KINDS; ++k)
+			if (l.cur.aggs[k])
+				l.cur.aggs[k]->ms += (now - l.cur.since) / 1000;
+	l.cur.since = now;
+}
+
+// FNV-1a
+uint32_t hash(const char *s) {
+	uint32_t h = 0x811c9dc5;
+	for (; *s; ++s)
+		h = (h ^ (unsigned char) *s) * 0x01000193;
+	return h;
+}
+
+struct str *intern(const char *s) {
+	uint32_t h;
+	struct str *i;
+	size_t len;
+	if (!s || !*s)
+		return NULL;
+	h = hash(s);
+	for (i = l.strings[h % STR_BUCKETS]; i; i = i->next)
+		if (i->hash == h && !strcmp(i->s, s))
+			break;
+	if (!i) {
+		len = strlen(s) + 1;
+		i = malloc(sizeof(*i) + len);
+		memcpy(i->s, s, len);
+		i->hash = h;
+		i->refs = 0;
+		i->next = l.strings[h % STR_BUCKETS];
+		l.strings[h % STR_BUCKETS] = i;
+	}
+	i->refs++;
+	return i;
+}
+
+void release(struct str *s) {
+	struct str **p;
+	if (!s || --s->refs)
+		return;
+	for (p = &l.strings[s->hash % STR_BUCKETS]; *p != s; p = &(*p)->next);
+	*p = s->next;
+	free(s);
+}
+
+// finds or creates the aggregate, NULL for songs without the tags
+struct agg *aggregate(enum kind k, const char *a, const char *b) {
+	struct table *t = &l.tables[k];
+	struct str *sa, *sb = NULL;
+	struct agg *g, **bucket;
+	if (!a || !*a || (k != KIND_ARTIST && (!b || !*b)))
+		return NULL;
+	sa = intern(a);
+	if (k != KIND_ARTIST)
+		sb = intern(b);
+	bucket = &t->buckets[(sa->hash * 31 + (sb ? sb->hash : 0)) % AGG_BUCKETS];
+	for (g = *bucket; g; g = g->next)
+		if (g->a == sa && g->b == sb)
+			break;
+	if (g) {
+		// the aggregate holds its own references
+		release(sa);
+		release(sb);
+	} else {
+		if (l.max && t->count >= l.max)
+			evict(t);
+		g = calloc(1, sizeof(*g));
+		g->a = sa;
+		g->b = sb;
+		g->next = *bucket;
+		*bucket = g;
+		t->count++;
+	}
+	g->pinned = true;
+	return g;
+}
+
+static int by_ms(const void *x, const void *y) {
+	uint64_t a = (*(struct agg *const *) x)->ms, b = (*(struct agg *const *) y)->ms;
+	return a < b ? -1 : a > b;
+}
+
+// folds the least listened quarter of the table into its other total
+void evict(struct table *t) {
+	struct agg **all = malloc(t->count * sizeof(*all)), *g, **p;
+	size_t n = 0, i, drop = t->count / 4 ? t->count / 4 : 1;
+	for (i = 0; i < AGG_BUCKETS; ++i)
+		for (g = t->buckets[i]; g; g = g->next)
+			if (!g->pinned)
+				all[n++] = g;
+	qsort(all, n, sizeof(*all), by_ms);
+	for (i = 0; i < n && i < drop; ++i)
+		all[i]->doomed = true;
+	free(all);
+	for (i = 0; i < AGG_BUCKETS; ++i) {
+		for (p = &t->buckets[i]; (g = *p);) {
+			if (!g->doomed) {
+				p = &g->next;
+				continue;
+			}
+			*p = g->next;
+			t->other_plays += g->plays;
+			t->other_ms += g->ms;
+			t->count--;
+			release(g->a);
+			release(g->b);
+			free(g);
+		}
+	}
+}
+
+// tabs and newlines would break the snapshot's lines
+void put_value(FILE *f, const struct str *s) {
+	const char *c;
+	for (c = s ? s->s : ""; *c; ++c)
+		fputc(*c == '\t' || *c == '\n' ? ' ' : *c, f);
+}
+
+// restores the aggregates from the previous snapshot
+void load() {
+	char *line = NULL, *fields[5], *c;
+	struct agg *g;
+	size_t cap = 0, n;
+	unsigned k;
+	FILE *f;
+	if (!(f = fopen(l.path, "r")))
+		return;
+	while (getline(&line, &cap, f) > 0) {
+		if (*line == '#')
+			continue;
+		line[strcspn(line, "\n")] = 0;
+		for (n = 0, c = line; n < 5 && c; ++n) {
+			fields[n] = c;
+			if ((c = strchr(c, '\t')))
+				*c++ = 0;
+		}
+		if (n < 4)
+			continue;
+		for (k = 0; k < KINDS; ++k) {
+			if (!strcmp(fields[0], "other") && !strcmp(fields[3], kind_names[k])) {
+				l.tables[k].other_plays += strtoull(fields[1], NULL, 10);
+				l.tables[k].other_ms += (uint64_t) (strtod(fields[2], NULL) * 1000 + 0.5);
+			} else if (!strcmp(fields[0], kind_names[k]) &&
+					(g = aggregate(k, fields[3], n > 4 ? fields[4] : NULL))) {
+				g->plays += strtoull(fields[1], NULL, 10);
+				g->ms += (uint64_t) (strtod(fields[2], NULL) * 1000 + 0.5);
+				g->pinned = false;
+			}
+		}
+	}
+	free(line);
+	fclose(f);
+}
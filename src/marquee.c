@@ -0,0 +1,114 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "marquee.h"
+#include "width.h"
+
+/* Scrolls lines wider than the marquee by one character per tick. A line
+ * is laid out once, when it is set: it is stored followed by a gap, twice
+ * over, so that every window is a contiguous slice, along with the byte
+ * offset and column of each character boundary. A tick then only moves
+ * the window's ends along those boundaries and copies the slice into a
+ * buffer reused between lines. Zero-width characters stay with the one
+ * before them, and a window ending before a wide character is padded. */
+
+#define GAP "   "
+
+static bool grow(void **p, size_t *cap, size_t n, size_t size);
+
+static struct {
+	unsigned width;
+	// the current line, as set
+	char *line;
+	size_t len, line_cap;
+	// line, gap, line, gap
+	char *loop;
+	size_t loop_cap;
+	// the boundaries of the characters in loop, n per line and gap
+	size_t *off;
+	unsigned *col;
+	size_t n, bound_cap;
+	// the window spans the characters pos to end
+	size_t pos, end;
+	char *buf;
+	size_t buf_cap;
+	bool scrolling;
+} m;
+
+void marquee_init(unsigned width) {
+	m.width = width;
+}
+
+/* Lays the line out (up to its first newline), returns whether it is
+ * wider than the marquee and thus has to scroll. The position is kept if
+ * it is the line already set. */
+bool marquee_set(const char *line) {
+	size_t len = strcspn(line, "\n"), half, i, k, n;
+	unsigned w, cols;
+	if (m.line && len == m.len && !memcmp(line, m.line, len))
+		return m.scrolling;
+	grow((void **) &m.line, &m.line_cap, len + 1, 1);
+	memcpy(m.line, line, len);
+	m.line[len] = 0;
+	m.len = len;
+	m.pos = m.end = 0;
+	width_fit(line, len, -1, &cols);
+	if (!(m.scrolling = cols > m.width))
+		return false;
+	half = len + strlen(GAP);
+	grow((void **) &m.loop, &m.loop_cap, 2 * half, 1);
+	memcpy(m.loop, line, len);
+	memcpy(m.loop + len, GAP, half - len);
+	memcpy(m.loop + half, m.loop, half);
+	// at most one boundary per byte, in each half and at the end
+	if (grow((void **) &m.off, &m.bound_cap, 2 * half + 1, sizeof(*m.off)))
+		m.col = realloc(m.col, m.bound_cap * sizeof(*m.col));
+	for (i = k = 0, cols = 0; i < half; i += n) {
+		n = width_next(m.loop + i, half - i, &w);
+		if (w || !k) {
+			m.off[k] = i;
+			m.col[k++] = cols;
+		}
+		cols += w;
+	}
+	m.n = k;
+	for (k = 0; k < m.n; ++k) {
+		m.off[k + m.n] = m.off[k] + half;
+		m.col[k + m.n] = m.col[k] + cols;
+	}
+	m.off[2 * m.n] = 2 * half;
+	m.col[2 * m.n] = 2 * cols;
+	grow((void **) &m.buf, &m.buf_cap, half + m.width + 1, 1);
+	return true;
+}
+
+// the current window, padded to the marquee's width; moves it on by one
+const char *marquee_next() {
+	size_t len;
+	unsigned cols;
+	if (!m.scrolling)
+		return m.line;
+	// a line wider than the marquee never fills a window with both halves
+	while (m.end < 2 * m.n && m.col[m.end + 1] - m.col[m.pos] <= m.width)
+		m.end++;
+	len = m.off[m.end] - m.off[m.pos];
+	cols = m.col[m.end] - m.col[m.pos];
+	memcpy(m.buf, m.loop + m.off[m.pos], len);
+	memset(m.buf + len, ' ', m.width - cols);
+	m.buf[len + m.width - cols] = 0;
+	if (++m.pos == m.n) {
+		m.pos = 0;
+		m.end -= m.n;
+	}
+	return m.buf;
+}
+
+// grows *p to hold at least n elements of size bytes, returns whether it did
+bool grow(void **p, size_t *cap, size_t n, size_t size) {
+	if (n <= *cap)
+		return false;
+	*cap = n > 2 * *cap ? n : 2 * *cap;
+	*p = realloc(*p, *cap * size);
+	return true;
+}
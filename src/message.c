@@ -0,0 +1,18 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "message.h"
+
+void message(const struct messages *m, const char *fmt, ...) {
+	char buf[512];
+	va_list ap;
+	va_start(ap, fmt);
+	if (m && m->print) {
+		vsnprintf(buf, sizeof(buf), fmt, ap);
+		m->print(m->data, buf);
+	} else {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+	va_end(ap);
+}
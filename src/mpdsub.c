@@ -9,32 +9,77 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <setjmp.h>
+#include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
 
 #include <mpd/client.h>
 
 #include "connect.h"
+#include "control.h"
+#include "cover.h"
 #include "daemon.h"
+#include "dump.h"
 #include "formats.h"
+#include "history.h"
+#include "i3bar.h"
 #include "ini.h"
+#include "listen.h"
+#include "marquee.h"
+#include "queue.h"
+#include "sink.h"
+#include "stats.h"
+#include "sticker.h"
+#include "trace.h"
 #include "util.h"
+#include "watch.h"
 
 #define DEFAULT_HOST "localhost"
 #define DEFAULT_PORT 6600
 
 #define DEFAULT_FORMAT "%artist%%title||| - %%album| (|)%"
-static char *fallback_formats[] = {"%artist%%title||| - %", "%name%", "%file%", NULL};
 
 #define IDLE_MASK MPD_IDLE_PLAYER
+#define QUEUE_IDLE_MASK MPD_IDLE_QUEUE
+#define STICKER_IDLE_MASK MPD_IDLE_STICKER
+#define DB_IDLE_MASK MPD_IDLE_DATABASE
 #define CONN_RETRY_INTERVAL 3
+#define DEFAULT_COVER_SIZE 64
+#define DEFAULT_ROTATE_COUNT 3
+#define DEFAULT_LISTEN_INTERVAL 300
+#define DEFAULT_LISTEN_MAX 10000
+#define DEFAULT_MARQUEE_TICK 250
 
-void read_formats(void);
-void print_song(struct mpd_song *, struct mpd_status *status);
+void read_formats(char *format, char *queue_format);
+void print_song(struct format_data *, char *pre);
+void put_song(const char *);
+void put_line(const char *);
+void scroll(void *);
+int click(void *, struct mpd_connection *, enum mpd_idle *);
+int config_changed(void *, struct mpd_connection *, enum mpd_idle *);
+void reload_config(enum mpd_idle *);
+int control(void *, struct mpd_connection *, enum mpd_idle *);
+void listen_control(void);
+int quit(struct mpd_connection *, int res);
+void print_queue(struct mpd_connection *, struct mpd_status *);
+bool fetch_next(struct mpd_connection *, struct mpd_status *);
+void prerender_next(struct mpd_connection *, struct mpd_status *);
+void drop_next(void);
+char *fetch_cover(struct mpd_connection *, struct format_data *);
+const struct stickers *fetch_stickers(struct mpd_connection *, struct format_data *);
+bool recv_db_stats(struct mpd_connection *);
+void record_history(struct format_data *, int id);
+void update_listen(struct format_data *, enum mpd_state);
+int query_history(void);
 void read_config();
+int reload_cb(void *, const char *, const char *, const char *);
 void read_params(int, char **);
+void watch_config(void);
 void handle_error(struct mpd_connection *);
+void connection_lost(void);
 char *expand_path(const char *path);
+long parse_size(const char *size);
+bool parse_escape(struct sink *, const char *mode);
 
 int usage(void);
 int help(void);
@@ -43,33 +88,103 @@ void sighandler(int sig);
 void sighandler_setup(void);
 void setsigmask(bool);
 
-static struct format_list {
-	struct format_token *tok;
-	struct format_list *next;
-} formats;
+static struct format_list formats, queue_formats;
+static struct format_strings strings = {"playing", "stopped", "paused", "unknown"};
+static struct song_slots current;
+static struct sticker_cache stickers;
+static struct db_stats db;
+// when the server last replied
+static uint64_t alive;
+// the song id last added to the history
+static int recorded = -1;
+// whether the output is wider than the marquee
+static bool scrolling;
+static struct idle_hooks hooks = {.ticked = scroll};
+
+static char *configs[] = {"~/.mpdsub.conf", "~/.config/mpdsub.conf"};
+// reports changes to the config files
+static int config_fd = -1;
+static int control_fd = -1;
+// the reconnect or shutdown requested through the control socket
+static int requested;
+
+// the song tags stored in the history, besides the uri
+static const enum mpd_tag_type history_types[HISTORY_URI] = {
+	[HISTORY_ARTIST] = MPD_TAG_ARTIST,
+	[HISTORY_ALBUM_ARTIST] = MPD_TAG_ALBUM_ARTIST,
+	[HISTORY_ALBUM] = MPD_TAG_ALBUM,
+	[HISTORY_TITLE] = MPD_TAG_TITLE,
+	[HISTORY_NAME] = MPD_TAG_NAME,
+};
+
+static struct {
+	struct mpd_song *song;
+	char *out, *cover;
+} next;
 
 static struct {
-	char *host, *format, *outf, *password, *pidfile, *logfile;
-	int port, retry:1, overwrite:1, daemon:1, kill:1;
-	FILE *outfile;
+	char *host, *format, *password, *pidfile, *logfile, *statsf, *dump_filter,
+		*history, *control;
+	struct {
+		char *from, *to;
+	} query;
+	int port, dump_threads, keepalive, probe, retry:1, daemon:1, kill:1, dump:1, stickers:1, db:1, local:1,
+		i3bar:1, fixed_format:1, fixed_queue_format:1;
+	struct sink out;
+	struct {
+		struct sink out;
+		char *format;
+		int length;
+	} queue;
+	struct {
+		char *dir;
+		int size;
+	} cover;
+	struct {
+		char *path;
+		int interval, max;
+	} listen;
+	struct {
+		int width, tick;
+	} marquee;
+	enum mpd_idle idle_mask;
 } params;
 
 static jmp_buf cb, lb;
 
 int main(int argc, char **argv) {
-	int res = 0;
+	int res = 0, id;
+	enum mpd_idle events;
+	uint64_t t, ev;
 	enum mpd_state state;
 	struct mpd_connection *conn;
-	struct mpd_status *status;
-	struct mpd_song *song;
+	struct format_data data;
+	char *pre, *cover, *sock;
+	bool refresh;
 	read_config();
 	read_params(argc, argv);
-	read_formats();
+	read_formats(params.format, params.queue.format);
+	if (params.query.from)
+		return query_history();
 	sighandler_setup();
 	setjmp(cb);
+reconnect:
+	drop_next();
+	queue_reset();
+	stickers_invalidate(&stickers);
+	db.valid = false;
+	t = stats_begin();
 	do {
 		setsigmask(true);
-		res = connect_mpd(&conn, params.host, params.port, params.password);
+		trace(connect_attempt, params.host, params.port);
+		res = 0;
+		// a co-located mpd is preferably reached through its socket
+		if (params.local && (sock = find_socket())) {
+			res = connect_mpd(&conn, sock, 0, params.password, NULL);
+			free(sock);
+		}
+		if (!res)
+			res = connect_mpd(&conn, params.host, params.port, params.password, NULL);
 		if (!res && !params.retry) res = -1;
 		setsigmask(false);
 		if (!res)
@@ -78,75 +193,404 @@ int main(int argc, char **argv) {
 	if (res < 0) {
 		exit(EXIT_FAILURE);
 	}
+	stats_end(STATS_CONNECT, t);
+	set_keepalive(conn, params.keepalive, NULL);
+	alive = stats_clock();
+	trace(connect_success, params.host, params.port);
 	switch ((res = setjmp(lb))) {
 	case -1:
 	case 1:
-		log("Terminating.\n");
-		mpd_connection_free(conn);
-		if (params.pidfile && params.daemon)
-			if (unlink(params.pidfile)) {
-				log("%s\n", params.pidfile);
-				perror("Failed to unlink pidfile");
-			}
-		return res == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+		return quit(conn, res);
 	case 2:
 		log("Idle await interrupted.\n");
+		if (params.statsf)
+			stats_dump(params.statsf);
+		if (params.listen.path)
+			listen_snapshot();
 		if (!mpd_run_noidle(conn))
 			handle_error(conn);
 		break;
 	}
+	if (params.dump) {
+		if (!dump_db(conn, &formats, &params.out, params.dump_filter,
+					params.dump_threads)) {
+			log("Dump failed: %s\n", mpd_connection_get_error_message(conn));
+			longjmp(lb, -1);
+		}
+		longjmp(lb, 1);
+	}
+	events = params.idle_mask;
 	while (1) {
 		setsigmask(true);
-		status = mpd_run_status(conn);
-		if (!status)
+		ev = t = stats_begin();
+		data.song = NULL;
+		data.slots = NULL;
+		data.stickers = NULL;
+		data.cover = pre = cover = NULL;
+		data.db = &db;
+		refresh = params.db && (!db.valid || events & DB_IDLE_MASK);
+		// one round trip for the status, the current song and, if they
+		// are not cached, the library stats and the stickers of the song
+		// playing until now
+		trace(status_begin);
+		if (!mpd_command_list_begin(conn, true) || !mpd_send_status(conn) ||
+				!mpd_send_current_song(conn) ||
+				(refresh && !mpd_send_stats(conn)) ||
+				(params.stickers && !stickers_send(&stickers, conn, song_slots_uri(&current))) ||
+				!mpd_command_list_end(conn))
+			handle_error(conn);
+		data.status = mpd_recv_status(conn);
+		if (!data.status || !mpd_response_next(conn))
+			handle_error(conn);
+		trace(status_end);
+		stats_end(STATS_STATUS, t);
+		state = mpd_status_get_state(data.status);
+		id = mpd_status_get_song_id(data.status);
+		// the output is dropped on sticker events, the song is then
+		// rendered anew; with repeat and single (or a single entry
+		// queue) mpd predicts the current song, which is no track change
+		if ((state == MPD_STATE_PLAY || state == MPD_STATE_PAUSE) &&
+				next.song && next.out &&
+				id == (int) mpd_song_get_id(next.song) &&
+				!(current.valid && id == (int) current.id)) {
+			// the predicted song started, output it before anything else
+			put_song(pre = next.out);
+			data.song = next.song;
+			data.cover = cover = next.cover;
+			next.song = NULL;
+			next.out = NULL;
+			next.cover = NULL;
+		}
+		t = stats_begin();
+		trace(song_begin);
+		if (!song_slots_recv(conn, &current) ||
+				(refresh && !recv_db_stats(conn)) || !stickers_recv(&stickers, conn) ||
+				!mpd_response_finish(conn))
 			handle_error(conn);
-		state = mpd_status_get_state(status);
+		trace(song_end);
+		stats_end(STATS_SONG, t);
 		if (state == MPD_STATE_PLAY || state == MPD_STATE_PAUSE) {
-			song = mpd_run_current_song(conn);
-			if (!song)
-				handle_error(conn);
-			print_song(song, status);
-		} else {
-			print_song(NULL, status);
+			if (!data.song) {
+				data.slots = &current;
+				if (params.cover.dir)
+					data.cover = cover = fetch_cover(conn, &data);
+			}
+			if (params.stickers)
+				data.stickers = fetch_stickers(conn, &data);
+			if (fetch_next(conn, data.status))
+				events |= IDLE_MASK;
+		} else if (next.song) {
+			drop_next();
+			events |= IDLE_MASK;
 		}
+		if (params.cover.dir)
+			cover_set_current(cover);
+		if (params.history && state == MPD_STATE_PLAY && id != recorded)
+			record_history(&data, id);
+		if (params.listen.path)
+			update_listen(&data, state);
+		data.next = next.song;
+		// queue-only changes need no new output unless the next song changed
+		if (events & ~QUEUE_IDLE_MASK)
+			print_song(&data, pre);
+		prerender_next(conn, data.status);
+		if (params.queue.length)
+			print_queue(conn, data.status);
+		stats_end(STATS_EVENT, ev);
+		free(pre);
+		free(cover);
+		if (data.song)
+			mpd_song_free(data.song);
+		mpd_status_free(data.status);
 		setsigmask(false);
-		res = mpd_run_idle_mask(conn, IDLE_MASK);
-		if (!res)
+		t = stats_begin();
+		// the marquee only scrolls while playing
+		hooks.tick = scrolling && state == MPD_STATE_PLAY ? params.marquee.tick : 0;
+		events = wait_idle(conn, params.idle_mask, params.probe, &alive, &hooks, NULL);
+		if (!events) {
 			handle_error(conn);
+			// an unanswered probe leaves no error on the connection
+			connection_lost();
+		}
+		if (requested == CONTROL_SHUTDOWN) {
+			return quit(conn, 1);
+		} else if (requested == CONTROL_RECONNECT) {
+			requested = 0;
+			log("Reconnecting!\n");
+			mpd_connection_free(conn);
+			goto reconnect;
+		}
+		if (events & STICKER_IDLE_MASK) {
+			// the pre-rendered next song may show stale stickers
+			stickers_invalidate(&stickers);
+			free(next.out);
+			next.out = NULL;
+		}
+		trace(idle_wakeup, events);
+		stats_end(STATS_IDLE, t);
 	}
 }
 
-void print_song(struct mpd_song *song, struct mpd_status *status) {
-	int cnt;
-	char *c = NULL;
-	struct format_list *l = formats.next;
-	setsigmask(true);
-	if (params.overwrite && params.outf) {
-		rewind(params.outfile);
-		if (truncate(params.outf, 0))
-			log("Could not truncate outfile. Expect unexpected results.");
+// fetches the next queue entry, unless it is the one already cached
+bool fetch_next(struct mpd_connection *conn, struct mpd_status *status) {
+	int id = mpd_status_get_next_song_id(status);
+	if (next.song && id == (int) mpd_song_get_id(next.song))
+		return false;
+	if (id < 0 && !next.song)
+		return false;
+	drop_next();
+	if (id < 0)
+		return true;
+	next.song = mpd_run_get_queue_song_id(conn, id);
+	if (!next.song)
+		handle_error(conn);
+	return true;
+}
+
+// renders the cached next song as it will be output once it starts playing,
+// its art and stickers are fetched ahead of time as well
+void prerender_next(struct mpd_connection *conn, struct mpd_status *status) {
+	struct format_data data = {.song = next.song, .status = status, .db = &db};
+	if (!next.song || next.out)
+		return;
+	if (params.cover.dir && !next.cover)
+		next.cover = fetch_cover(conn, &data);
+	data.cover = next.cover;
+	if (params.stickers)
+		data.stickers = fetch_stickers(conn, &data);
+	next.out = render_song(&formats, &data);
+}
+
+void drop_next() {
+	if (next.song)
+		mpd_song_free(next.song);
+	free(next.out);
+	free(next.cover);
+	next.song = NULL;
+	next.out = NULL;
+	next.cover = NULL;
+}
+
+// looks up the song's art, transferring it into the cache on a miss
+char *fetch_cover(struct mpd_connection *conn, struct format_data *data) {
+	const char *artist = format_data_tag(data, MPD_TAG_ALBUM_ARTIST);
+	char *c = cover_fetch(conn, format_data_uri(data),
+		artist ? artist : format_data_tag(data, MPD_TAG_ARTIST),
+		format_data_tag(data, MPD_TAG_ALBUM));
+	if (!c)
+		handle_error(conn);
+	return c;
+}
+
+// receives the stats response, following the previous response in the list
+bool recv_db_stats(struct mpd_connection *conn) {
+	struct mpd_stats *stats;
+	if (!mpd_response_next(conn) || !(stats = mpd_recv_stats(conn)))
+		return false;
+	db.songs = mpd_stats_get_number_of_songs(stats);
+	db.artists = mpd_stats_get_number_of_artists(stats);
+	db.albums = mpd_stats_get_number_of_albums(stats);
+	db.playtime = mpd_stats_get_db_play_time(stats);
+	db.uptime = mpd_stats_get_uptime(stats);
+	db.fetched = stats_clock();
+	db.valid = true;
+	mpd_stats_free(stats);
+	return true;
+}
+
+// appends the song which started playing to the history
+void record_history(struct format_data *data, int id) {
+	struct history_item it = {
+		.time = time(NULL),
+		.id = id,
+		.duration = mpd_status_get_total_time(data->status)
+	};
+	size_t i;
+	for (i = 0; i < HISTORY_URI; ++i)
+		it.tags[i] = format_data_tag(data, history_types[i]);
+	it.tags[HISTORY_URI] = format_data_uri(data);
+	history_append(&it);
+	recorded = id;
+}
+
+// credits the listening time since the previous event
+void update_listen(struct format_data *data, enum mpd_state state) {
+	struct listen_song song = {
+		.id = mpd_status_get_song_id(data->status),
+		.artist = format_data_tag(data, MPD_TAG_ARTIST),
+		.album_artist = format_data_tag(data, MPD_TAG_ALBUM_ARTIST),
+		.album = format_data_tag(data, MPD_TAG_ALBUM),
+		.title = format_data_tag(data, MPD_TAG_TITLE)
+	};
+	listen_update(state == MPD_STATE_PLAY,
+		state == MPD_STATE_PLAY || state == MPD_STATE_PAUSE ? &song : NULL);
+}
+
+static void print_history(void *ctx, const struct history_item *it) {
+	struct format_data data = {.slots = &current};
+	time_t t = it->time;
+	char ts[32], *c;
+	(void) ctx;
+	song_slots_set(&current, it->tags[HISTORY_URI], it->tags, history_types, HISTORY_URI);
+	current.id = it->id;
+	current.duration = it->duration;
+	strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	c = render_song(&formats, &data);
+	printf("%s\t%s\n", ts, c);
+	free(c);
+}
+
+// outputs the songs played in the queried range, rendered with the format
+int query_history() {
+	int64_t from, to;
+	if (!params.history) {
+		log("--history-query requires --history.\n");
+		return EXIT_FAILURE;
 	}
-	cnt = format_song(&c, song, status, formats.tok);
-	if (!cnt)
-		do
-			free(c);
-		while (!(cnt = format_song(&c, song, status, l->tok)) && (l = l->next));
-	fprintf(params.outfile, "%s\n", c);
+	if (!history_parse_time(params.query.from, &from) ||
+			!history_parse_time(params.query.to, &to)) {
+		log("Invalid time range: %s - %s\n", params.query.from, params.query.to);
+		return EXIT_FAILURE;
+	}
+	if (history_query(params.history, from, to, print_history, NULL) < 0)
+		return EXIT_FAILURE;
+	fflush(stdout);
+	return EXIT_SUCCESS;
+}
+
+const struct stickers *fetch_stickers(struct mpd_connection *conn,
+		struct format_data *data) {
+	const struct stickers *s = stickers_fetch(&stickers, conn, format_data_uri(data));
+	if (!s)
+		handle_error(conn);
+	return s;
+}
+
+// renders and outputs the song, unless the output is the same as pre
+void print_song(struct format_data *data, char *pre) {
+	size_t len;
+	char *c;
+	uint64_t t = stats_begin();
+	trace(render_begin);
+	c = render_song(&formats, data);
+	len = strlen(c);
+	trace(render_end, len);
+	stats_end(STATS_RENDER, t);
+	if (!pre || strcmp(c, pre))
+		put_song(c);
 	free(c);
-	fflush(params.outfile);
+}
+
+// outputs a rendered song, or its first window if it has to scroll
+void put_song(const char *c) {
+	if ((scrolling = params.marquee.width && marquee_set(c)))
+		c = marquee_next();
+	put_line(c);
+}
+
+// writes a line to the output, as an i3bar block in that mode
+void put_line(const char *c) {
+	if (params.i3bar)
+		i3bar_write(&params.out, c);
+	else
+		sink_write(&params.out, c);
+}
+
+// outputs the next marquee window, between events
+void scroll(void *data) {
+	(void) data;
+	setsigmask(true);
+	put_line(marquee_next());
+	setsigmask(false);
+}
+
+// runs the commands bound to i3bar clicks, between events
+int click(void *data, struct mpd_connection *conn, enum mpd_idle *events) {
+	int r;
+	(void) data;
+	(void) events;
+	setsigmask(true);
+	r = i3bar_click(conn);
 	setsigmask(false);
+	return r;
 }
 
-void read_formats() {
-	char **p = fallback_formats;
-	struct format_list *l = &formats;
-	l->tok = parse_format(params.format);
-	while (*p) {
-		l->next = calloc(1, sizeof(struct format_list));
-		l = l->next;
-		l->tok = parse_format(*p);
-		p++;
+// outputs the upcoming queue window, one rendered entry per line
+void print_queue(struct mpd_connection *conn, struct mpd_status *status) {
+	struct format_data data = {.status = status, .db = &db};
+	size_t s = 128, pos = 0, len;
+	unsigned i;
+	char *buf, *c;
+	switch (queue_update(conn, status)) {
+	case -1:
+		handle_error(conn);
+		return;
+	case 0:
+		return;
+	}
+	buf = calloc(s, 1);
+	for (i = 0; i < queue_window() && (data.song = queue_entry(i)); ++i) {
+		c = render_song(&queue_formats, &data);
+		len = strlen(c);
+		while (pos + len + 2 > s)
+			buf = realloc(buf, s *= 2);
+		if (pos)
+			buf[pos++] = '\n';
+		memcpy(buf + pos, c, len + 1);
+		pos += len;
+		free(c);
 	}
+	sink_write(&params.queue.out, buf);
+	free(buf);
+}
+
+// compiles the formats off to the side, then swaps them in at once
+void read_formats(char *format, char *queue_format) {
+	struct format_list f = {NULL, NULL}, q = {NULL, NULL};
+	struct format_options o = {params.out.escape, &strings, NULL},
+		qo = {params.queue.out.escape, &strings, NULL};
+	size_t i;
+	compile_formats(&f, format, &o);
+	if (params.queue.length)
+		compile_formats(&q, queue_format, &qo);
+	free_formats(&formats);
+	free_formats(&queue_formats);
+	formats = f;
+	queue_formats = q;
+	// the current song is decoded with only the tags the formats use
+	memset(current.wanted, 0, sizeof(current.wanted));
+	format_tags(&formats, current.wanted);
+	if (params.history || params.listen.path)
+		for (i = 0; i < HISTORY_URI; ++i)
+			current.wanted[history_types[i]] = true;
+	// the art cache is keyed by album
+	if (params.cover.dir)
+		current.wanted[MPD_TAG_ALBUM] = current.wanted[MPD_TAG_ALBUM_ARTIST] =
+			current.wanted[MPD_TAG_ARTIST] = true;
+	params.idle_mask &= ~(STICKER_IDLE_MASK | DB_IDLE_MASK);
+	if ((params.stickers = format_stickers(&formats)))
+		params.idle_mask |= STICKER_IDLE_MASK;
+	if ((params.db = format_db_stats(&formats) || format_db_stats(&queue_formats)))
+		params.idle_mask |= DB_IDLE_MASK;
+}
+
+// flushes and saves everything before exiting
+int quit(struct mpd_connection *conn, int res) {
+	log("Terminating.\n");
+	sink_flush_all();
+	mpd_connection_free(conn);
+	if (params.statsf)
+		stats_dump(params.statsf);
+	if (params.listen.path)
+		listen_snapshot();
+	if (control_fd >= 0)
+		unlink(params.control);
+	if (params.pidfile && params.daemon)
+		if (unlink(params.pidfile)) {
+			log("%s\n", params.pidfile);
+			perror("Failed to unlink pidfile");
+		}
+	return res == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 void handle_error(struct mpd_connection *conn) {
@@ -154,12 +598,7 @@ void handle_error(struct mpd_connection *conn) {
 		if (!mpd_connection_clear_error(conn)) {
 			log("Connection error: %s\n",
 				mpd_connection_get_error_message(conn));
-			if (params.retry) {
-				log("Reconnecting!\n");
-				longjmp(cb, 1);
-			} else {
-				longjmp(lb, -1);
-			}
+			connection_lost();
 		} else {
 			log("Protocol level error: %s\n"
 				"Incompatible server version. Terminating.\n",
@@ -169,6 +608,18 @@ void handle_error(struct mpd_connection *conn) {
 	}
 }
 
+// reports how long the server had been silent when the loss was noticed
+void connection_lost() {
+	log("Connection lost %.1fs after the last reply.\n",
+		(stats_clock() - alive) / 1e6);
+	if (params.retry) {
+		log("Reconnecting!\n");
+		longjmp(cb, 1);
+	} else {
+		longjmp(lb, -1);
+	}
+}
+
 void sighandler(int sig) {
 	switch (sig) {
 	case SIGTERM:
@@ -179,6 +630,9 @@ void sighandler(int sig) {
 		longjmp(cb, 1);
 	case SIGUSR2:
 		longjmp(lb, 2);
+	case SIGALRM:
+		sink_flush_all();
+		break;
 	}
 }
 
@@ -190,6 +644,7 @@ void sighandler_setup() {
 	sigaction(SIGHUP, &sa, NULL);
 	sigaction(SIGUSR1, &sa, NULL);
 	sigaction(SIGUSR2, &sa, NULL);
+	sigaction(SIGALRM, &sa, NULL);
 }
 
 void setsigmask(bool set) {
@@ -202,6 +657,7 @@ void setsigmask(bool set) {
 		sigaddset(&mask, SIGHUP);
 		sigaddset(&mask, SIGUSR1);
 		sigaddset(&mask, SIGUSR2);
+		sigaddset(&mask, SIGALRM);
 		sigprocmask(SIG_BLOCK, set ? &mask : NULL, &orig);
 		i++;
 	} else {
@@ -222,17 +678,56 @@ static struct option opts[] = {
 	{"outfile",	optional_argument,	NULL,	'o'},
 	{"pidfile",	required_argument,	NULL,	1},
 	{"logfile",	required_argument,	NULL,	'l'},
+	{"stats-file",	required_argument,	NULL,	2},
+	{"queue-length",	required_argument,	NULL,	3},
+	{"queue-format",	required_argument,	NULL,	4},
+	{"queue-outfile",	required_argument,	NULL,	5},
+	{"dump",	no_argument,		NULL,	6},
+	{"dump-filter",	required_argument,	NULL,	7},
+	{"dump-threads",	required_argument,	NULL,	8},
+	{"cover-dir",	required_argument,	NULL,	9},
+	{"cover-size",	required_argument,	NULL,	10},
+	{"keepalive",	required_argument,	NULL,	11},
+	{"probe-interval",	required_argument,	NULL,	12},
+	{"rotate-size",	required_argument,	NULL,	13},
+	{"rotate-count",	required_argument,	NULL,	14},
+	{"flush-lines",	required_argument,	NULL,	15},
+	{"flush-interval",	required_argument,	NULL,	16},
+	{"fsync",	no_argument,		NULL,	17},
+	{"history",	required_argument,	NULL,	18},
+	{"history-query",	required_argument,	NULL,	19},
+	{"listen-stats",	required_argument,	NULL,	20},
+	{"listen-interval",	required_argument,	NULL,	21},
+	{"listen-max",	required_argument,	NULL,	22},
+	{"max-width",	required_argument,	NULL,	23},
+	{"marquee",	required_argument,	NULL,	24},
+	{"marquee-interval",	required_argument,	NULL,	25},
+	{"escape",	required_argument,	NULL,	26},
+	{"queue-escape",	required_argument,	NULL,	27},
+	{"i3bar",	no_argument,		NULL,	28},
+	{"control",	required_argument,	NULL,	29},
 	{NULL,		0,			NULL,	0}
 };
 
 static char *descriptions[] = {
 	"display this help",
-	"mpd instance hostname (or socket file, defaults to localhost)",
+	"mpd instance hostname (or socket file, defaults to localhost),\n"
+		"\t\tpassword@host is accepted, as in MPD_HOST (for a local host\n"
+		"\t\twithout a port, $XDG_RUNTIME_DIR/mpd/socket and /run/mpd/socket\n"
+		"\t\tare tried first)",
 	"mpd instance port (defaults to 6600)",
 	"password for mpd instance",
 	"song format: text with tokens in format\n"
 		"\t\t'%tag|prefix|suffix|condprefix%' (each optional)\n"
-		"\t\t(condprefix is output iff the previous tag is present)",
+		"\t\t(condprefix is output iff the previous tag is present)\n"
+		"\t\t(%next_TAG% refers to the next song in the queue)\n"
+		"\t\t'%tag:filter%' filters the tag value (N: at most N columns, cut with an ellipsis,\n"
+		"\t\t0N: zero-padded to N digits, upper, lower, time, basename)\n"
+		"\t\t'%( ... %| ... %)' outputs the first alternative with all tags present\n"
+		"\t\t(%cover% is the cached album art path, see --cover-dir)\n"
+		"\t\t(%sticker:NAME% is the current song's sticker NAME)\n"
+		"\t\t(%db_songs%, %db_artists%, %db_albums%, %db_playtime% and\n"
+		"\t\t%uptime% are updated on database changes)",
 	"if specified, overwrite output file with latest song only",
 	"keep trying to reconnect to mpd",
 	"run in background",
@@ -240,6 +735,47 @@ static char *descriptions[] = {
 	"output file (defaults to stdout)",
 	"pidfile location",
 	"logfile location",
+	"write latency histograms (Prometheus text format)\n"
+		"\t\ton SIGUSR2 and on exit",
+	"number of upcoming queue entries to output (defaults to 0, off)",
+	"format of upcoming queue entries (defaults to --format)",
+	"output file for upcoming queue entries (defaults to stdout)",
+	"output every song in the database and exit",
+	"only dump songs matching the filter expression (as for 'find')",
+	"number of threads formatting dumped songs (defaults to 1)",
+	"album art cache directory (enables %cover%, DIR/current\n"
+		"\t\tlinks to the art of the current song)",
+	"album art cache size limit in MiB (defaults to 64)",
+	"drop a TCP connection to an unresponsive mpd after about\n"
+		"\t\tKEEPALIVE seconds (TCP keepalive and user timeout, defaults to 0, off)",
+	"probe mpd with noidle after PROBE-INTERVAL seconds without events,\n"
+		"\t\treconnecting if it does not reply as quickly (defaults to 0, off)",
+	"rotate the output file once it exceeds ROTATE-SIZE bytes\n"
+		"\t\t(K, M and G suffixes are accepted, not with --overwrite)",
+	"number of rotated output files to keep (defaults to 3)",
+	"flush the output file every FLUSH-LINES lines (defaults to 1)",
+	"flush the output file at most FLUSH-INTERVAL seconds after a line",
+	"fsync the output file whenever it is flushed",
+	"append every song played to an indexed binary history file",
+	"output the songs in --history played between HISTORY-QUERY and\n"
+		"\t\tthe next argument (seconds since the epoch or local\n"
+		"\t\tYYYY-MM-DD[ HH:MM[:SS]]), rendered with --format, and exit",
+	"keep plays and listened time per artist, album and track,\n"
+		"\t\tsaved to (and restored from) LISTEN-STATS",
+	"seconds between listening statistics snapshots (defaults to 300)",
+	"most artists, albums and tracks tracked each, the least listened\n"
+		"\t\tare summed up as other (defaults to 10000)",
+	"cut output lines to MAX-WIDTH display columns, with an ellipsis",
+	"scroll songs wider than MARQUEE display columns while playing",
+	"milliseconds between marquee steps (defaults to 250)",
+	"escape tag values for the output's consumer: pango, shell\n"
+		"\t\t(quoted), json (string contents), csv (quoted), strip-control\n"
+		"\t\tor none (the default)",
+	"escape tag values in upcoming queue entries (as for --escape)",
+	"speak the i3bar/swaybar protocol on stdout, running the mpd\n"
+		"\t\tcommands bound to clicks (see the [i3bar] config section)",
+	"listen on the CONTROL unix socket for reload, reconnect, stats\n"
+		"\t\tand shutdown commands",
 	NULL
 };
 
@@ -248,15 +784,73 @@ static_assert(sizeof(opts)/sizeof(opts[0]) == sizeof(descriptions)/sizeof(descri
 
 int parse_cb(void *data, const char *section, const char *name, const char *value) {
 	(void) data;(void) section;
-	if (!strcasecmp(name, "outfile"))
-		params.outf = expand_path(value);
+	if (!strcasecmp(section, "queue")) {
+		if (!strcasecmp(name, "outfile"))
+			params.queue.out.path = expand_path(value);
+		else if (!strcasecmp(name, "format"))
+			params.queue.format = strdup(value);
+		else if (!strcasecmp(name, "length"))
+			params.queue.length = atoi(value);
+		else if (!strcasecmp(name, "max_width"))
+			params.queue.out.max_width = atoi(value);
+		else if (!strcasecmp(name, "escape"))
+			parse_escape(&params.queue.out, value);
+	} else if (!strcasecmp(section, "i3bar")) {
+		if (!strncasecmp(name, "button", 6) && isdigit((unsigned char) name[6]) &&
+				!i3bar_bind(atoi(name + 6), value))
+			log("Invalid i3bar button '%s'\n", name);
+	} else if (!strcasecmp(section, "cover")) {
+		if (!strcasecmp(name, "dir"))
+			params.cover.dir = expand_path(value);
+		else if (!strcasecmp(name, "size"))
+			params.cover.size = atoi(value);
+	} else if (!strcasecmp(name, "outfile"))
+		params.out.path = expand_path(value);
 	else if (!strcasecmp(name, "pidfile"))
 		params.pidfile = expand_path(value);
 	else if (!strcasecmp(name, "logfile"))
 		params.logfile = expand_path(value);
+	else if (!strcasecmp(name, "max_width"))
+		params.out.max_width = atoi(value);
+	else if (!strcasecmp(name, "escape"))
+		parse_escape(&params.out, value);
+	else if (!strcasecmp(name, "i3bar")
+			&& !strcasecmp(value, "true"))
+		params.i3bar = true;
+	else if (!strcasecmp(name, "marquee"))
+		params.marquee.width = atoi(value);
+	else if (!strcasecmp(name, "marquee_interval"))
+		params.marquee.tick = atoi(value);
+	else if (!strcasecmp(name, "rotate_size"))
+		params.out.max_size = parse_size(value);
+	else if (!strcasecmp(name, "rotate_count"))
+		params.out.count = atoi(value);
+	else if (!strcasecmp(name, "flush_lines"))
+		params.out.flush_lines = atoi(value);
+	else if (!strcasecmp(name, "flush_interval"))
+		params.out.flush_interval = atoi(value);
+	else if (!strcasecmp(name, "fsync")
+			&& !strcasecmp(value, "true"))
+		params.out.fsync = true;
+	else if (!strcasecmp(name, "keepalive"))
+		params.keepalive = atoi(value);
+	else if (!strcasecmp(name, "probe_interval"))
+		params.probe = atoi(value);
+	else if (!strcasecmp(name, "listen_stats"))
+		params.listen.path = expand_path(value);
+	else if (!strcasecmp(name, "listen_interval"))
+		params.listen.interval = atoi(value);
+	else if (!strcasecmp(name, "listen_max"))
+		params.listen.max = atoi(value);
+	else if (!strcasecmp(name, "history"))
+		params.history = expand_path(value);
+	else if (!strcasecmp(name, "control"))
+		params.control = expand_path(value);
+	else if (!strcasecmp(name, "stats_file"))
+		params.statsf = expand_path(value);
 	else if (!strcasecmp(name, "overwrite")
 			&& !strcasecmp(value, "true"))
-		params.overwrite = true;
+		params.out.overwrite = true;
 	else if (!strcasecmp(name, "retry")
 			&& !strcasecmp(value, "true"))
 		params.retry = true;
@@ -276,7 +870,6 @@ int parse_cb(void *data, const char *section, const char *name, const char *valu
 }
 
 void read_config() {
-	static char *configs[] = {"~/.mpdsub.conf", "~/.config/mpdsub.conf"};
 	size_t i;
 	char *c;
 	for (i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
@@ -285,6 +878,104 @@ void read_config() {
 	}
 }
 
+// the settings that are reloaded, formats from the command line are kept
+struct reload {
+	char *format, *queue_format;
+};
+
+int reload_cb(void *data, const char *section, const char *name, const char *value) {
+	struct reload *r = data;
+	if (!strcasecmp(section, "queue")) {
+		if (!strcasecmp(name, "format")) {
+			free(r->queue_format);
+			r->queue_format = strdup(value);
+		}
+	} else if (!strcasecmp(section, "strings")) {
+		// the previous strings may be literals, they are not freed
+		parse_cb(NULL, section, name, value);
+	} else if (!strcasecmp(name, "format")) {
+		free(r->format);
+		r->format = strdup(value);
+	}
+	return true;
+}
+
+// reloads the config when one of its files changes, between events
+int config_changed(void *data, struct mpd_connection *conn, enum mpd_idle *events) {
+	int changed;
+	(void) data;
+	(void) conn;
+	if ((changed = watch_changed(config_fd)) <= 0)
+		return changed + 1;
+	setsigmask(true);
+	log("Config changed, reloading.\n");
+	reload_config(events);
+	setsigmask(false);
+	return 1;
+}
+
+/* The formats are compiled anew and the output re-rendered from a fresh
+ * status, over the same connection. */
+void reload_config(enum mpd_idle *events) {
+	struct reload r = {NULL, NULL};
+	char *format, *queue_format, *c;
+	size_t i;
+	for (i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+		ini_parse(c = expand_path(configs[i]), reload_cb, &r);
+		free(c);
+	}
+	format = params.fixed_format ? params.format :
+		r.format ? r.format : DEFAULT_FORMAT;
+	queue_format = params.fixed_queue_format ? params.queue.format :
+		r.queue_format ? r.queue_format : format;
+	read_formats(format, queue_format);
+	free(r.format);
+	free(r.queue_format);
+	// nothing rendered with the old formats is reused
+	drop_next();
+	queue_reset();
+	stickers_invalidate(&stickers);
+	db.valid = false;
+	*events |= IDLE_MASK | (params.queue.length ? QUEUE_IDLE_MASK : 0);
+}
+
+// serves the control socket's clients, between events
+int control(void *data, struct mpd_connection *conn, enum mpd_idle *events) {
+	struct control_client client;
+	int c;
+	(void) data;
+	(void) conn;
+	setsigmask(true);
+	while ((c = control_accept(control_fd, &client)) >= 0) {
+		switch (c) {
+		case CONTROL_RELOAD:
+			log("Reload requested.\n");
+			reload_config(events);
+			break;
+		case CONTROL_STATS:
+			stats_write(client.out);
+			if (params.statsf)
+				stats_dump(params.statsf);
+			if (params.listen.path)
+				listen_snapshot();
+			break;
+		case CONTROL_RECONNECT:
+		case CONTROL_SHUTDOWN:
+			// acted on once out of the wait, which this ends
+			requested = c;
+			*events |= IDLE_MASK;
+			break;
+		}
+		if (c == CONTROL_UNKNOWN)
+			fputs("ERR unknown command\n", client.out);
+		else if (c != CONTROL_STATS)
+			fputs("OK\n", client.out);
+		control_reply(&client);
+	}
+	setsigmask(false);
+	return 1;
+}
+
 void read_params(int argc, char **argv) {
 	int c;
 	char *p;
@@ -303,9 +994,10 @@ void read_params(int argc, char **argv) {
 			break;
 		case 'f':
 			params.format = strdup(optarg);
+			params.fixed_format = true;
 			break;
 		case 'O':
-			params.overwrite = true;
+			params.out.overwrite = true;
 			break;
 		case 'r':
 			params.retry = true;
@@ -317,11 +1009,11 @@ void read_params(int argc, char **argv) {
 			params.kill = true;
 			break;
 		case 'o':
-			free(params.outf);
+			free(params.out.path);
 			if (!strcmp(optarg, "-"))
-				params.outf = NULL;
+				params.out.path = NULL;
 			else
-				params.outf = expand_path(optarg);
+				params.out.path = expand_path(optarg);
 			break;
 		case 'l':
 			free(params.logfile);
@@ -331,6 +1023,105 @@ void read_params(int argc, char **argv) {
 			free(params.pidfile);
 			params.pidfile = expand_path(optarg);
 			break;
+		case 2:
+			free(params.statsf);
+			params.statsf = expand_path(optarg);
+			break;
+		case 3:
+			params.queue.length = atoi(optarg);
+			break;
+		case 4:
+			params.queue.format = strdup(optarg);
+			params.fixed_queue_format = true;
+			break;
+		case 5:
+			free(params.queue.out.path);
+			if (!strcmp(optarg, "-"))
+				params.queue.out.path = NULL;
+			else
+				params.queue.out.path = expand_path(optarg);
+			break;
+		case 6:
+			params.dump = true;
+			break;
+		case 7:
+			params.dump_filter = strdup(optarg);
+			break;
+		case 8:
+			params.dump_threads = atoi(optarg);
+			break;
+		case 9:
+			free(params.cover.dir);
+			params.cover.dir = expand_path(optarg);
+			break;
+		case 10:
+			params.cover.size = atoi(optarg);
+			break;
+		case 11:
+			params.keepalive = atoi(optarg);
+			break;
+		case 12:
+			params.probe = atoi(optarg);
+			break;
+		case 13:
+			params.out.max_size = parse_size(optarg);
+			break;
+		case 14:
+			params.out.count = atoi(optarg);
+			break;
+		case 15:
+			params.out.flush_lines = atoi(optarg);
+			break;
+		case 16:
+			params.out.flush_interval = atoi(optarg);
+			break;
+		case 17:
+			params.out.fsync = true;
+			break;
+		case 18:
+			free(params.history);
+			params.history = expand_path(optarg);
+			break;
+		case 19:
+			if (optind >= argc)
+				usage();
+			params.query.from = optarg;
+			params.query.to = argv[optind++];
+			break;
+		case 20:
+			free(params.listen.path);
+			params.listen.path = expand_path(optarg);
+			break;
+		case 21:
+			params.listen.interval = atoi(optarg);
+			break;
+		case 22:
+			params.listen.max = atoi(optarg);
+			break;
+		case 23:
+			params.out.max_width = atoi(optarg);
+			break;
+		case 24:
+			params.marquee.width = atoi(optarg);
+			break;
+		case 25:
+			params.marquee.tick = atoi(optarg);
+			break;
+		case 26:
+			if (!parse_escape(&params.out, optarg))
+				usage();
+			break;
+		case 27:
+			if (!parse_escape(&params.queue.out, optarg))
+				usage();
+			break;
+		case 28:
+			params.i3bar = true;
+			break;
+		case 29:
+			free(params.control);
+			params.control = expand_path(optarg);
+			break;
 		default:
 		case '?':
 			if (!optopt)
@@ -339,32 +1130,136 @@ void read_params(int argc, char **argv) {
 				usage();
 		}
 	}
-	if (!params.host) {
-		params.host = getenv("MPD_HOST");
-		if (!params.host)
-			params.host = DEFAULT_HOST;
+	if (!params.host && (p = getenv("MPD_HOST")))
+		params.host = strdup(p);
+	// password@host, a leading '@' is an abstract socket instead
+	if (params.host && *params.host != '@' && (p = strchr(params.host, '@'))) {
+		*p = 0;
+		if (!params.password)
+			params.password = strdup(params.host);
+		params.host = p + 1;
 	}
+	if (!params.host)
+		params.host = DEFAULT_HOST;
+	params.local = !params.port && !getenv("MPD_PORT") &&
+		(!strcmp(params.host, "localhost") || !strcmp(params.host, "127.0.0.1") ||
+		!strcmp(params.host, "::1"));
 	if (!params.port || params.port < 0 || params.port > 65535) {
-		p = getenv("MPD_HOST");
+		p = getenv("MPD_PORT");
 		if (!p || !(params.port = atoi(p)) ||
 				params.port < 0 || params.port > 65535)
 			params.port = DEFAULT_PORT;
 	}
 	if (!params.format)
 		params.format = DEFAULT_FORMAT;
+	if (!params.queue.format)
+		params.queue.format = params.format;
+	if (params.queue.length < 0)
+		params.queue.length = 0;
+	params.idle_mask = IDLE_MASK;
+	if (params.queue.length) {
+		queue_init(params.queue.length);
+		params.idle_mask |= QUEUE_IDLE_MASK;
+	}
+	if (params.statsf)
+		stats_enabled = true;
+	if (params.cover.size <= 0)
+		params.cover.size = DEFAULT_COVER_SIZE;
+	if (params.cover.dir && !params.dump &&
+			!cover_init(params.cover.dir, params.cover.size * 1024UL * 1024))
+		exit(EXIT_FAILURE);
+	// queries only read the history
+	if (params.query.from)
+		return;
 	if (params.kill)
 		kill_instance(params.pidfile, !params.daemon);
 	if (params.daemon)
 		daemonize(&params.pidfile, params.logfile);
-	if (params.outf) {
-		params.outfile = fopen(params.outf, "w+");
-		if (!params.outfile) {
-			perror("Could not open the output file for writing");
+	if (params.out.max_size < 0)
+		params.out.max_size = 0;
+	if (params.out.count <= 0)
+		params.out.count = DEFAULT_ROTATE_COUNT;
+	if (params.out.flush_lines < 0)
+		params.out.flush_lines = 0;
+	if (params.out.flush_interval < 0)
+		params.out.flush_interval = 0;
+	if (params.dump)
+		params.i3bar = false;
+	// the bar reads every block from stdout as soon as it is written
+	if (params.i3bar) {
+		free(params.out.path);
+		params.out.path = NULL;
+		params.out.overwrite = false;
+		params.out.max_width = 0;
+		params.out.flush_lines = params.out.flush_interval = 0;
+		// queue lines on stdout would break the bar's JSON stream
+		if (params.queue.length && !params.queue.out.path) {
+			log("--i3bar needs a --queue-outfile for the queue entries.\n");
 			exit(EXIT_FAILURE);
 		}
-	} else {
-		params.outfile = stdout;
 	}
+	// widths are measured on the escaped output, which is not cut
+	if (params.out.max_width && !escape_cuttable(params.out.escape)) {
+		log("The maximum width is ignored with quoting or markup escaping.\n");
+		params.out.max_width = 0;
+	}
+	if (params.queue.out.max_width && !escape_cuttable(params.queue.out.escape)) {
+		log("The queue's maximum width is ignored with quoting or markup escaping.\n");
+		params.queue.out.max_width = 0;
+	}
+	if (params.marquee.width && !escape_cuttable(params.out.escape)) {
+		log("The marquee is disabled with quoting or markup escaping.\n");
+		params.marquee.width = 0;
+	}
+	if (!sink_open(&params.out))
+		exit(EXIT_FAILURE);
+	if (!params.dump)
+		watch_config();
+	if (params.control && !params.dump)
+		listen_control();
+	if (params.i3bar) {
+		i3bar_init(&params.out, params.out.escape == ESCAPE_PANGO);
+		hooks.watch[hooks.nwatch++] = (struct idle_watch) {STDIN_FILENO, click};
+	}
+	if (params.marquee.width < 0 || params.dump)
+		params.marquee.width = 0;
+	if (params.marquee.tick <= 0)
+		params.marquee.tick = DEFAULT_MARQUEE_TICK;
+	if (params.marquee.width)
+		marquee_init(params.marquee.width);
+	params.queue.out.overwrite = true;
+	if (params.queue.length && !sink_open(&params.queue.out))
+		exit(EXIT_FAILURE);
+	if (params.history && !params.dump && !history_open(params.history))
+		exit(EXIT_FAILURE);
+	if (params.listen.interval <= 0)
+		params.listen.interval = DEFAULT_LISTEN_INTERVAL;
+	if (params.listen.max <= 0)
+		params.listen.max = DEFAULT_LISTEN_MAX;
+	if (params.dump)
+		params.listen.path = NULL;
+	if (params.listen.path)
+		listen_init(params.listen.path, params.listen.interval, params.listen.max);
+}
+
+void listen_control() {
+	if ((control_fd = control_listen(params.control)) < 0)
+		exit(EXIT_FAILURE);
+	hooks.watch[hooks.nwatch++] = (struct idle_watch) {control_fd, control};
+	// served on request
+	stats_enabled = true;
+}
+
+// reloads the config whenever one of its files changes
+void watch_config() {
+	char *paths[sizeof(configs) / sizeof(configs[0])];
+	size_t i, n = sizeof(paths) / sizeof(paths[0]);
+	for (i = 0; i < n; ++i)
+		paths[i] = expand_path(configs[i]);
+	if ((config_fd = watch_files(paths, n)) >= 0)
+		hooks.watch[hooks.nwatch++] = (struct idle_watch) {config_fd, config_changed};
+	for (i = 0; i < n; ++i)
+		free(paths[i]);
 }
 
 char *expand_path(const char *path) {
@@ -378,6 +1273,33 @@ char *expand_path(const char *path) {
 
 }
 
+// a size in bytes, with an optional K, M or G suffix
+long parse_size(const char *size) {
+	char *end;
+	long n = strtol(size, &end, 10);
+	switch (toupper((unsigned char) *end)) {
+	case 'G':
+		n *= 1024;
+		// fall through
+	case 'M':
+		n *= 1024;
+		// fall through
+	case 'K':
+		n *= 1024;
+	}
+	return n;
+}
+
+bool parse_escape(struct sink *s, const char *mode) {
+	int e = escape_parse(mode);
+	if (e < 0) {
+		log("Unknown escape mode '%s'\n", mode);
+		return false;
+	}
+	s->escape = e;
+	return true;
+}
+
 int usage() {
 	fprintf(stderr, "Usage: mpdsub [OPTION...]\n");
 	exit(EXIT_FAILURE);
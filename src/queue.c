@@ -0,0 +1,145 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpd/client.h>
+
+#include "queue.h"
+#include "util.h"
+
+/* A local mirror of the queue entries following the current song.
+ * Entry i holds the song at queue position start + i. It is kept up to
+ * date with plchangesposid against the mirrored queue version, so that
+ * only entries which changed or entered the window are fetched. */
+struct queue_entry {
+	unsigned id;
+	bool changed;
+	struct mpd_song *song;
+};
+
+static struct {
+	unsigned length, start, version;
+	bool synced;
+	struct queue_entry *entries, *scratch;
+} mirror;
+
+static bool recv_changes(struct mpd_connection *, unsigned start);
+static bool fetch_range(struct mpd_connection *, unsigned from, unsigned to);
+
+void queue_init(unsigned length) {
+	mirror.length = length;
+	mirror.entries = calloc(length, sizeof(struct queue_entry));
+	mirror.scratch = calloc(length, sizeof(struct queue_entry));
+}
+
+// drops the mirror, the next update resyncs only the window
+void queue_reset() {
+	unsigned i;
+	for (i = 0; i < mirror.length; ++i) {
+		if (mirror.entries[i].song)
+			mpd_song_free(mirror.entries[i].song);
+		mirror.entries[i].song = NULL;
+	}
+	mirror.synced = false;
+}
+
+unsigned queue_window() {
+	return mirror.length;
+}
+
+struct mpd_song *queue_entry(unsigned i) {
+	return i < mirror.length ? mirror.entries[i].song : NULL;
+}
+
+// returns 1 if the window contents changed, 0 if not and -1 on errors
+int queue_update(struct mpd_connection *conn, struct mpd_status *status) {
+	int pos = mpd_status_get_song_pos(status);
+	unsigned start = pos < 0 ? 0 : (unsigned) pos + 1,
+		 qlen = mpd_status_get_queue_length(status),
+		 version = mpd_status_get_queue_version(status),
+		 i, j, p, from;
+	struct queue_entry *old = mirror.entries, *e = mirror.scratch;
+	int changed = !mirror.synced || start != mirror.start;
+	if (!changed && version == mirror.version)
+		return 0;
+	memset(e, 0, mirror.length * sizeof(struct queue_entry));
+	if (mirror.synced && version != mirror.version)
+		if (!recv_changes(conn, start))
+			return -1;
+	for (i = 0; mirror.synced && i < mirror.length && (p = start + i) < qlen; ++i) {
+		if (e[i].changed) {
+			// the entry may have only moved, if it was reported at its
+			// old position it was modified in place and is refetched
+			for (j = 0; j < mirror.length; ++j)
+				if (old[j].song && old[j].id == e[i].id &&
+						mirror.start + j != p)
+					break;
+		} else if (p >= mirror.start) {
+			j = p - mirror.start;
+		} else {
+			continue;
+		}
+		if (j < mirror.length && old[j].song) {
+			changed |= e[i].changed;
+			e[i] = old[j];
+			e[i].changed = false;
+			old[j].song = NULL;
+		}
+	}
+	for (j = 0; j < mirror.length; ++j) {
+		if (old[j].song) {
+			mpd_song_free(old[j].song);
+			old[j].song = NULL;
+			changed = 1;
+		}
+	}
+	mirror.entries = e;
+	mirror.scratch = old;
+	mirror.start = start;
+	for (i = 0; i < mirror.length && start + i < qlen; ++i) {
+		if (e[i].song)
+			continue;
+		for (from = i; i < mirror.length && start + i < qlen && !e[i].song; ++i);
+		if (!fetch_range(conn, start + from, start + i)) {
+			queue_reset();
+			return -1;
+		}
+		changed = 1;
+	}
+	mirror.version = version;
+	mirror.synced = true;
+	return changed;
+}
+
+// marks the window positions reported as changed since the mirrored version
+bool recv_changes(struct mpd_connection *conn, unsigned start) {
+	unsigned pos, id;
+	if (!mpd_send_queue_changes_brief(conn, mirror.version))
+		return false;
+	while (mpd_recv_queue_change_brief(conn, &pos, &id)) {
+		if (pos < start || pos - start >= mirror.length)
+			continue;
+		mirror.scratch[pos - start].id = id;
+		mirror.scratch[pos - start].changed = true;
+	}
+	return mpd_response_finish(conn);
+}
+
+bool fetch_range(struct mpd_connection *conn, unsigned from, unsigned to) {
+	struct mpd_song *song;
+	struct queue_entry *e;
+	if (!mpd_send_list_queue_range_meta(conn, from, to))
+		return false;
+	while ((song = mpd_recv_song(conn))) {
+		if (mpd_song_get_pos(song) < from || mpd_song_get_pos(song) >= to) {
+			mpd_song_free(song);
+			continue;
+		}
+		e = &mirror.entries[mpd_song_get_pos(song) - mirror.start];
+		if (e->song)
+			mpd_song_free(e->song);
+		e->id = mpd_song_get_id(song);
+		e->song = song;
+	}
+	return mpd_response_finish(conn);
+}
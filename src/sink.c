@@ -0,0 +1,130 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "sink.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+#include "width.h"
+
+#define MAX_SINKS 4
+
+static void rotate(struct sink *);
+static void put_lines(struct sink *, const char *);
+
+// the open sinks, for sink_flush_all
+static struct sink *sinks[MAX_SINKS];
+static unsigned nsinks;
+// whether an interval flush is scheduled
+static volatile bool armed;
+
+// opens the sink's file, or stdout when no path is set
+bool sink_open(struct sink *s) {
+	if (!s->path) {
+		s->file = stdout;
+	} else if (!(s->file = fopen(s->path, "w+"))) {
+		log("%s: ", s->path);
+		perror("Could not open the output file for writing");
+		return false;
+	}
+	s->size = 0;
+	s->pending = 0;
+	if (nsinks < MAX_SINKS)
+		sinks[nsinks++] = s;
+	return true;
+}
+
+void sink_write(struct sink *s, const char *c) {
+	uint64_t t = stats_begin();
+	size_t len = strlen(c) + 1;
+	if (s->overwrite && s->path) {
+		rewind(s->file);
+		if (truncate(s->path, 0))
+			log("Could not truncate outfile. Expect unexpected results.");
+	}
+	if (s->max_width)
+		put_lines(s, c);
+	else
+		fprintf(s->file, "%s\n", c);
+	s->size += len;
+	s->pending++;
+	if (s->overwrite || (!s->flush_lines && !s->flush_interval) ||
+			(s->flush_lines && s->pending >= s->flush_lines))
+		sink_flush(s);
+	else if (s->flush_interval && !armed) {
+		// delivered (and flushed) while waiting for events
+		armed = true;
+		alarm(s->flush_interval);
+	}
+	// rotating between lines loses none, unlike copytruncate
+	if (!s->overwrite && s->path && s->max_size && s->size >= s->max_size)
+		rotate(s);
+	trace(write, len);
+	stats_end(STATS_WRITE, t);
+}
+
+void sink_flush(struct sink *s) {
+	if (!s->file)
+		return;
+	fflush(s->file);
+	if (s->fsync && s->pending && s->path)
+		fsync(fileno(s->file));
+	s->pending = 0;
+}
+
+// flushes the lines still buffered in any sink (on SIGALRM and exit)
+void sink_flush_all() {
+	unsigned i;
+	armed = false;
+	for (i = 0; i < nsinks; ++i)
+		if (sinks[i]->pending)
+			sink_flush(sinks[i]);
+}
+
+// writes every line cut to the sink's width
+void put_lines(struct sink *s, const char *c) {
+	const char *e;
+	size_t n;
+	int ellipsis;
+	for (;; c = e + 1) {
+		if (!(e = strchr(c, '\n')))
+			e = c + strlen(c);
+		n = width_truncate(c, e - c, s->max_width, &ellipsis);
+		fwrite(c, 1, n, s->file);
+		if (ellipsis)
+			fputs(ELLIPSIS, s->file);
+		fputc('\n', s->file);
+		if (!*e)
+			break;
+	}
+}
+
+// moves path.N-1 to path.N, ..., path to path.1 and reopens path
+void rotate(struct sink *s) {
+	size_t len = strlen(s->path) + 12;
+	char *from = malloc(len), *to = malloc(len);
+	int i;
+	sink_flush(s);
+	fclose(s->file);
+	for (i = s->count; i > 0; --i) {
+		snprintf(to, len, "%s.%d", s->path, i);
+		if (i > 1)
+			snprintf(from, len, "%s.%d", s->path, i - 1);
+		else
+			snprintf(from, len, "%s", s->path);
+		if (rename(from, to) && i == 1)
+			perror("Could not rotate the output file");
+	}
+	free(from);
+	free(to);
+	if (!(s->file = fopen(s->path, "w+"))) {
+		log("%s: ", s->path);
+		perror("Could not reopen the output file");
+		exit(EXIT_FAILURE);
+	}
+	s->size = 0;
+}
@@ -0,0 +1,81 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpd/client.h>
+
+#include "song.h"
+
+static unsigned short store(struct song_slots *, const char *);
+static void reset(struct song_slots *);
+
+// receives a song response (e.g. to currentsong) without finishing it,
+// false on errors
+bool song_slots_recv(struct mpd_connection *conn, struct song_slots *s) {
+	struct mpd_pair *pair;
+	enum mpd_tag_type t;
+	reset(s);
+	while ((pair = mpd_recv_pair(conn))) {
+		if (!strcmp(pair->name, "file")) {
+			s->uri = store(s, pair->value);
+			s->valid = true;
+		} else if (!strcmp(pair->name, "Id")) {
+			s->id = strtoul(pair->value, NULL, 10);
+		} else if (!strcmp(pair->name, "Pos")) {
+			s->pos = strtoul(pair->value, NULL, 10);
+		} else if (!strcmp(pair->name, "duration")) {
+			s->duration = strtod(pair->value, NULL) + 0.5;
+		} else if (!strcmp(pair->name, "Time")) {
+			if (!s->duration)
+				s->duration = strtoul(pair->value, NULL, 10);
+		} else if ((t = mpd_tag_name_parse(pair->name)) != MPD_TAG_UNKNOWN &&
+				s->wanted[t] && !s->tags[t]) {
+			s->tags[t] = store(s, pair->value);
+		}
+		mpd_return_pair(conn, pair);
+	}
+	return mpd_connection_get_error(conn) == MPD_ERROR_SUCCESS;
+}
+
+// fills the slots from stored values (e.g. the play history), all tags are kept
+void song_slots_set(struct song_slots *s, const char *uri, const char *const *tags,
+		const enum mpd_tag_type *types, size_t n) {
+	size_t i;
+	reset(s);
+	if (uri) {
+		s->uri = store(s, uri);
+		s->valid = true;
+	}
+	for (i = 0; i < n; ++i)
+		if (tags[i] && !s->tags[types[i]])
+			s->tags[types[i]] = store(s, tags[i]);
+}
+
+void reset(struct song_slots *s) {
+	s->valid = false;
+	s->used = 0;
+	s->uri = 0;
+	s->id = s->pos = s->duration = 0;
+	memset(s->tags, 0, sizeof(s->tags));
+}
+
+// copies the value into the buffer, truncating it if it does not fit
+unsigned short store(struct song_slots *s, const char *value) {
+	size_t len = strlen(value), off = s->used;
+	if (off >= SONG_BUF_SIZE - 1)
+		return 0;
+	if (len > SONG_BUF_SIZE - 1 - off)
+		len = SONG_BUF_SIZE - 1 - off;
+	memcpy(s->buf + off, value, len);
+	s->buf[off + len] = 0;
+	s->used += len + 1;
+	return off + 1;
+}
+
+const char *song_slots_tag(const struct song_slots *s, enum mpd_tag_type t) {
+	return s->tags[t] ? s->buf + s->tags[t] - 1 : NULL;
+}
+
+const char *song_slots_uri(const struct song_slots *s) {
+	return s->uri ? s->buf + s->uri - 1 : NULL;
+}
@@ -0,0 +1,96 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "clock.h"
+#include "stats.h"
+#include "util.h"
+
+#define BUCKETS (sizeof(bounds) / sizeof(bounds[0]))
+
+// upper bucket bounds in microseconds, the +Inf bucket is implicit
+static const uint64_t bounds[] = {
+	10, 25, 50, 100, 250, 500,
+	1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 10000000
+};
+
+static const char *phase_names[] = {
+	[STATS_IDLE] = "idle",
+	[STATS_STATUS] = "status",
+	[STATS_SONG] = "song",
+	[STATS_RENDER] = "render",
+	[STATS_WRITE] = "write",
+	[STATS_EVENT] = "event",
+	[STATS_CONNECT] = "connect",
+};
+
+static struct histogram {
+	uint64_t buckets[BUCKETS + 1];
+	uint64_t count, sum;
+} hist[STATS_PHASES];
+
+bool stats_enabled;
+
+uint64_t stats_clock() {
+	return clock_us();
+}
+
+void stats_record(enum stats_phase phase, uint64_t start) {
+	uint64_t d = stats_clock() - start;
+	struct histogram *h = &hist[phase];
+	size_t i;
+	for (i = 0; i < BUCKETS && d > bounds[i]; ++i);
+	h->buckets[i]++;
+	h->count++;
+	h->sum += d;
+}
+
+// writes the histograms in the Prometheus text format
+void stats_write(FILE *f) {
+	size_t i, p;
+	uint64_t acc;
+	fprintf(f, "# HELP mpdsub_phase_seconds Time spent in each phase of event handling.\n");
+	fprintf(f, "# TYPE mpdsub_phase_seconds histogram\n");
+	for (p = 0; p < STATS_PHASES; ++p) {
+		for (i = 0, acc = 0; i < BUCKETS; ++i) {
+			acc += hist[p].buckets[i];
+			fprintf(f, "mpdsub_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+				phase_names[p], bounds[i] / 1e6, acc);
+		}
+		fprintf(f, "mpdsub_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+			phase_names[p], hist[p].count);
+		fprintf(f, "mpdsub_phase_seconds_sum{phase=\"%s\"} %.6f\n",
+			phase_names[p], hist[p].sum / 1e6);
+		fprintf(f, "mpdsub_phase_seconds_count{phase=\"%s\"} %" PRIu64 "\n",
+			phase_names[p], hist[p].count);
+	}
+}
+
+int stats_dump(const char *path) {
+	size_t len;
+	char *tmp;
+	FILE *f;
+	if (!path)
+		return -1;
+	len = strlen(path) + 5;
+	tmp = malloc(len);
+	snprintf(tmp, len, "%s.tmp", path);
+	if (!(f = fopen(tmp, "w"))) {
+		perror("Could not open stats file for writing");
+		free(tmp);
+		return -1;
+	}
+	stats_write(f);
+	if (fclose(f) || rename(tmp, path)) {
+		perror("Could not write stats file");
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
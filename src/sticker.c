@@ -0,0 +1,185 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpd/client.h>
+
+#include "sticker.h"
+
+/* The stickers of recently played songs, keyed by URI, with the least
+ * recently used entry dropped once the cache is full. mpd does not say
+ * which song's stickers changed, so every entry is dropped on the
+ * sticker idle event. The cache is owned by the caller, one per
+ * connection. */
+
+#define CACHE_SIZE 256
+#define BUCKETS STICKER_BUCKETS
+
+// the song's stickers, packed as "name\0value\0" pairs
+struct stickers {
+	struct stickers *prev, *next, *chain;
+	uint32_t hash;
+	char *uri, *buf;
+	size_t len, cap;
+};
+
+static uint32_t hash(const char *uri);
+static struct stickers *lookup(struct sticker_cache *, const char *uri);
+static struct stickers *insert(struct sticker_cache *, const char *uri);
+static void drop(struct sticker_cache *, struct stickers *);
+static void append(struct stickers *, const char *, size_t);
+static struct stickers *recv_list(struct sticker_cache *, struct mpd_connection *,
+		const char *uri);
+
+// queues a lookup in the command list being sent, unless the uri is cached
+bool stickers_send(struct sticker_cache *cache, struct mpd_connection *conn,
+		const char *uri) {
+	if (!uri || cache->pending || lookup(cache, uri))
+		return true;
+	cache->pending = strdup(uri);
+	return mpd_send_sticker_list(conn, "song", uri);
+}
+
+// receives the queued lookup, following the previous response in the list
+bool stickers_recv(struct sticker_cache *cache, struct mpd_connection *conn) {
+	bool ok;
+	if (!cache->pending)
+		return true;
+	ok = mpd_response_next(conn) && recv_list(cache, conn, cache->pending);
+	free(cache->pending);
+	cache->pending = NULL;
+	return ok;
+}
+
+// returns the cached stickers, or looks them up, NULL on connection errors
+const struct stickers *stickers_fetch(struct sticker_cache *cache,
+		struct mpd_connection *conn, const char *uri) {
+	struct stickers *s;
+	if (!uri)
+		return NULL;
+	if ((s = lookup(cache, uri)))
+		return s;
+	if (!mpd_send_sticker_list(conn, "song", uri) ||
+			!(s = recv_list(cache, conn, uri)) || !mpd_response_finish(conn))
+		return NULL;
+	return s;
+}
+
+const char *stickers_value(const struct stickers *s, const char *name, size_t len) {
+	const char *c = s->buf, *end = s->buf + s->len;
+	while (c < end) {
+		if (!strncmp(c, name, len) && !c[len])
+			return c + len + 1;
+		c += strlen(c) + 1;
+		c += strlen(c) + 1;
+	}
+	return NULL;
+}
+
+// also forgets a lookup queued on a connection that was lost since
+void stickers_invalidate(struct sticker_cache *cache) {
+	while (cache->head)
+		drop(cache, cache->head);
+	free(cache->pending);
+	cache->pending = NULL;
+}
+
+// FNV-1a
+uint32_t hash(const char *uri) {
+	uint32_t h = 0x811c9dc5;
+	for (; *uri; ++uri)
+		h = (h ^ (unsigned char) *uri) * 0x01000193;
+	return h;
+}
+
+// finds the entry and marks it as the most recently used
+struct stickers *lookup(struct sticker_cache *cache, const char *uri) {
+	uint32_t h = hash(uri);
+	struct stickers *s;
+	for (s = cache->buckets[h % BUCKETS]; s; s = s->chain)
+		if (s->hash == h && !strcmp(s->uri, uri))
+			break;
+	if (!s || s == cache->head)
+		return s;
+	s->prev->next = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	else
+		cache->tail = s->prev;
+	s->prev = NULL;
+	s->next = cache->head;
+	cache->head->prev = s;
+	cache->head = s;
+	return s;
+}
+
+struct stickers *insert(struct sticker_cache *cache, const char *uri) {
+	struct stickers *s;
+	if ((s = lookup(cache, uri)))
+		drop(cache, s);
+	if (cache->count == CACHE_SIZE)
+		drop(cache, cache->tail);
+	s = calloc(1, sizeof(*s));
+	s->hash = hash(uri);
+	s->uri = strdup(uri);
+	s->chain = cache->buckets[s->hash % BUCKETS];
+	cache->buckets[s->hash % BUCKETS] = s;
+	if ((s->next = cache->head))
+		s->next->prev = s;
+	else
+		cache->tail = s;
+	cache->head = s;
+	cache->count++;
+	return s;
+}
+
+void drop(struct sticker_cache *cache, struct stickers *s) {
+	struct stickers **p = &cache->buckets[s->hash % BUCKETS];
+	for (; *p != s; p = &(*p)->chain);
+	*p = s->chain;
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		cache->head = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	else
+		cache->tail = s->prev;
+	cache->count--;
+	free(s->uri);
+	free(s->buf);
+	free(s);
+}
+
+void append(struct stickers *s, const char *v, size_t len) {
+	if (s->len + len + 1 > s->cap) {
+		while (s->len + len + 1 > s->cap)
+			s->cap = s->cap ? s->cap * 2 : 64;
+		s->buf = realloc(s->buf, s->cap);
+	}
+	memcpy(s->buf + s->len, v, len);
+	s->buf[s->len + len] = 0;
+	s->len += len + 1;
+}
+
+// receives a sticker list response into a new entry, NULL on connection errors
+struct stickers *recv_list(struct sticker_cache *cache, struct mpd_connection *conn,
+		const char *uri) {
+	struct stickers *s = insert(cache, uri);
+	struct mpd_pair *pair;
+	const char *v;
+	size_t len;
+	while ((pair = mpd_recv_sticker(conn))) {
+		if ((v = mpd_parse_sticker(pair->value, &len))) {
+			append(s, pair->value, len);
+			append(s, v, strlen(v));
+		}
+		mpd_return_sticker(conn, pair);
+	}
+	// songs outside the database (or an mpd without stickers) fail,
+	// which is cached as having no stickers
+	if (mpd_connection_get_error(conn) == MPD_ERROR_SERVER)
+		return mpd_connection_clear_error(conn) ? s : NULL;
+	return mpd_connection_get_error(conn) == MPD_ERROR_SUCCESS ? s : NULL;
+}
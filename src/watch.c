@@ -0,0 +1,73 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "watch.h"
+
+/* Files are watched through their directories, as editors often replace
+ * a file with a new one rather than writing to it. */
+
+#define MAX_FILES 4
+#define EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+static struct {
+	int wd;
+	char *name;
+} files[MAX_FILES];
+static size_t nfiles;
+
+// returns an inotify fd (-1 on errors) reporting changes to the files
+int watch_files(char *const *paths, size_t n) {
+	char *dir, *base;
+	size_t i;
+	int fd, wd;
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		perror("Could not watch the config");
+		return -1;
+	}
+	for (i = 0; i < n && nfiles < MAX_FILES; ++i) {
+		if (!paths[i])
+			continue;
+		dir = strdup(paths[i]);
+		base = strdup(paths[i]);
+		// a missing directory is not watched
+		if ((wd = inotify_add_watch(fd, dirname(dir), EVENTS)) >= 0) {
+			files[nfiles].wd = wd;
+			files[nfiles++].name = strdup(basename(base));
+		}
+		free(dir);
+		free(base);
+	}
+	return fd;
+}
+
+// reads the pending events, returns whether any is about a watched file
+// (-1 on errors)
+int watch_changed(int fd) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed = false;
+	ssize_t len;
+	char *p;
+	size_t i;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			for (i = 0; i < nfiles; ++i)
+				if (ev->wd == files[i].wd && ev->len &&
+						!strcmp(ev->name, files[i].name))
+					changed = true;
+		}
+	if (len < 0 && errno != EAGAIN) {
+		perror("Could not read config changes");
+		return -1;
+	}
+	return changed;
+}
@@ -0,0 +1,178 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "width.h"
+
+/* Display width of UTF-8 text, as a terminal or status bar renders it:
+ * East Asian wide and fullwidth characters (and most emoji) take two
+ * columns, combining marks and other zero-width characters none. The
+ * tables below are a compact subset of Unicode's, covering the common
+ * scripts, rather than an exhaustive copy. Invalid bytes count as one
+ * column each. */
+
+struct range {
+	uint32_t first, last;
+};
+
+static const struct range zero[] = {
+	{0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+	{0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a},
+	{0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc}, {0x06df, 0x06e4},
+	{0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0902}, {0x093a, 0x093a},
+	{0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+	{0x0962, 0x0963}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e},
+	{0x1160, 0x11ff}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f},
+	{0x202a, 0x202e}, {0x2060, 0x2064}, {0x20d0, 0x20ff}, {0x302a, 0x302d},
+	{0x3099, 0x309a}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff},
+	{0x1f3fb, 0x1f3ff}, {0xe0000, 0xe0fff},
+};
+
+static const struct range wide[] = {
+	{0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+	{0x23f0, 0x23f0}, {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615},
+	{0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+	{0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce},
+	{0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+	{0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+	{0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755},
+	{0x2757, 0x2757}, {0x2795, 0x2797}, {0x27b0, 0x27b0}, {0x27bf, 0x27bf},
+	{0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x303e},
+	{0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+	{0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19},
+	{0xfe30, 0xfe6f}, {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4},
+	{0x17000, 0x18cff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf},
+	{0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f2ff}, {0x1f300, 0x1f64f},
+	{0x1f680, 0x1f6ff}, {0x1f7e0, 0x1f7eb}, {0x1f900, 0x1f9ff}, {0x1fa70, 0x1faff},
+	{0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+};
+
+static bool in(const struct range *r, size_t n, uint32_t cp);
+static size_t decode(const unsigned char *s, size_t len, uint32_t *cp);
+static size_t scan(const char *, size_t, unsigned, unsigned *, int *, size_t *);
+
+unsigned width_char(uint32_t cp) {
+	// nothing below the combining diacritics is zero width or wide
+	if (cp < 0x300)
+		return 1;
+	// the bulk of CJK and Hangul text
+	if ((cp >= 0x4e00 && cp <= 0x9fff) || (cp >= 0xac00 && cp <= 0xd7a3))
+		return 2;
+	if (in(zero, sizeof(zero) / sizeof(zero[0]), cp))
+		return 0;
+	// nothing is wide below Hangul Jamo
+	return cp >= 0x1100 && in(wide, sizeof(wide) / sizeof(wide[0]), cp) ? 2 : 1;
+}
+
+// the length of the longest prefix fitting in max columns, its width in *w
+size_t width_fit(const char *s, size_t len, unsigned max, unsigned *w) {
+	int more;
+	return scan(s, len, max, w, &more, NULL);
+}
+
+// the length of the prefix to output within max columns, *ellipsis is set
+// if it has to be followed by an ellipsis (which takes the last column)
+size_t width_truncate(const char *s, size_t len, unsigned max, int *ellipsis) {
+	size_t cut, n = scan(s, len, max, NULL, ellipsis, &cut);
+	return *ellipsis ? cut : n;
+}
+
+// the length of the character at s, its width in *w
+size_t width_next(const char *s, size_t len, unsigned *w) {
+	uint32_t cp;
+	size_t n = decode((const unsigned char *) s, len, &cp);
+	*w = width_char(cp);
+	return n;
+}
+
+/* Scans up to max columns. If the text is longer, *more is set and *cut
+ * is the length of the prefix fitting in one column less. */
+size_t scan(const char *str, size_t len, unsigned max, unsigned *w,
+		int *more, size_t *cut) {
+	const unsigned char *s = (const unsigned char *) str;
+	size_t i = 0, n, last = 0;
+	unsigned cols = 0, cw;
+	uint64_t word;
+	uint32_t cp;
+	*more = 0;
+	while (i < len) {
+		// ASCII runs are taken 8 bytes at a time, while they surely fit
+		while (i + 8 <= len && cols + 9 <= max) {
+			memcpy(&word, s + i, 8);
+			if (word & 0x8080808080808080ull)
+				break;
+			i += 8;
+			cols += 8;
+		}
+		if (cols < max)
+			last = i;
+		if (i >= len)
+			break;
+		if (s[i] < 0x80) {
+			cp = s[i];
+			n = 1;
+		} else {
+			n = decode(s + i, len - i, &cp);
+		}
+		cw = width_char(cp);
+		if (cols + cw > max) {
+			*more = max > 0;
+			break;
+		}
+		cols += cw;
+		i += n;
+		// the last position still leaving room for an ellipsis
+		if (cols < max)
+			last = i;
+	}
+	if (w)
+		*w = cols;
+	if (cut)
+		*cut = last;
+	return i;
+}
+
+bool in(const struct range *r, size_t n, uint32_t cp) {
+	size_t lo = 0, hi = n, mid;
+	if (cp < r[0].first || cp > r[n - 1].last)
+		return false;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cp > r[mid].last)
+			lo = mid + 1;
+		else if (cp < r[mid].first)
+			hi = mid;
+		else
+			return true;
+	}
+	return false;
+}
+
+// decodes a multibyte sequence, an invalid one is a single byte (U+FFFD)
+size_t decode(const unsigned char *s, size_t len, uint32_t *cp) {
+	size_t n, i;
+	if (s[0] >= 0xf0 && s[0] < 0xf5) {
+		n = 4;
+		*cp = s[0] & 0x07;
+	} else if (s[0] >= 0xe0) {
+		n = s[0] < 0xf0 ? 3 : 0;
+		*cp = s[0] & 0x0f;
+	} else if (s[0] >= 0xc2) {
+		n = 2;
+		*cp = s[0] & 0x1f;
+	} else {
+		n = 0;
+	}
+	for (i = 1; n && i < n; ++i) {
+		if (i >= len || (s[i] & 0xc0) != 0x80)
+			n = 0;
+		else
+			*cp = *cp << 6 | (s[i] & 0x3f);
+	}
+	if (!n) {
+		*cp = 0xfffd;
+		return 1;
+	}
+	return n;
+}